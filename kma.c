@@ -54,15 +54,26 @@
  ***************************************************************************/
 
 #define __KMA_TEST_IMPL__
+#define _GNU_SOURCE   /* RUSAGE_THREAD */
 
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
+#include "kma_perf.h"
+#include "kma_trace.h"
+#include "kma_hist.h"
+#include "kma_live.h"
+#ifdef KMA_REGISTRY
+#include "kma_registry.h"
+#endif
 #include "kma.h"
 #include "time.h"
 
@@ -76,7 +87,8 @@
 enum REQ_STATE
   {
     FREE,
-    USED
+    USED,
+    REFUSED   // too large for the allocator, the trace still frees it
   };
 
 typedef struct mem
@@ -87,13 +99,64 @@ typedef struct mem
   enum REQ_STATE state;
 } mem_t;
 
+// what a page size sweep or replica child reports back
+typedef struct
+{
+  double time_ms;
+  double ratio;
+  int n_ops;
+} sweep_result_t;
+
+#define MAXSWEEP 16
+#define MAXREPLICAS 64
+#define MAXALLOCATORS 16
+
+// what a replay restarted with -X carries over to the new process
+typedef struct
+{
+  long offset;          // the trace operation the first process stopped at
+  int n_alloc;
+  int n_dealloc;
+  int index;
+  int val;
+  int alloc_bytes;      // currentAllocBytes
+  double live_byte_ops; // currentAllocBytes summed over the operations
+  double first_ms;      // time the first process spent replaying
+} restart_state_t;
+
+// set in the environment of the process that resumes a replay
+#define RESUMEVAR "KMA_RESUME"
+
 /************Global Variables*********************************************/
 
 static int val = 0;
 
+// write end of the pipe to the sweep parent, -1 if not sweeping
+static int sweep_fd = -1;
+
+// requests larger than a page, and how many of them were refused
+static int n_large = 0;
+static int n_refused = 0;
+
+// kma_malloc/kma_free latency by request size, the classes up to
+// class_bytes, then the requests that fit a page and the larger ones
+#define SIZECLASSES 5
+static int class_bytes[SIZECLASSES - 2] = { 64, 256, 1024 };
+static kma_hist_t malloc_hist[SIZECLASSES];
+static kma_hist_t free_hist[SIZECLASSES];
+
+// event counts of kma_malloc and kma_free, op_perf is NULL without -e
+static kma_perf_t* op_perf = NULL;
+static long long malloc_counts[PERF_MAXCOUNTERS];
+static long long free_counts[PERF_MAXCOUNTERS];
+
 /************Function Prototypes******************************************/
 void allocate();
+void allocate_live(kma_live_t*, unsigned int, int);
+void* alloc_block(int, void**);
 void deallocate();
+void deallocate_live(kma_live_t*, unsigned int);
+void free_block(void*, int, void*);
 void fill(char*, int);
 void check(char*, char*, int);
 void usage();
@@ -101,6 +164,21 @@ void error(char*, char*);
 void pass();
 void fail();
 int find_rounded_size(int);
+int parse_sizes(char*, int[]);
+void sweep(int[], int);
+void replicate(int, int);
+int size_class(int);
+void print_latency(int);
+void merge_classes(kma_hist_t[], kma_hist_t*);
+void print_page_latency(char*, unsigned int[]);
+void print_nodes(kma_page_stat_t*);
+double waste_ratio(kma_page_stat_t*, double);
+void restart(char*[], char*, mem_t*, int, restart_state_t*);
+void resume(char*, mem_t*, int, restart_state_t*);
+#ifdef KMA_REGISTRY
+void compare(char*, char*, char*);
+double replay_trace(kma_trace_t*, mem_t*, double*);
+#endif
 /************External Declaration*****************************************/
 
 
@@ -138,120 +216,349 @@ main(int argc, char* argv[])
 
   int n_req = 0, n_alloc=0, n_dealloc=0;
   kma_page_stat_t* stat;
-
+  // bytes asked for, summed over the operations like the pages in use
+  double liveByteOps = 0.0;
+  
+  char* events = NULL;
+  char* ms;
+  kma_perf_t perf;
+  kma_hist_t all;
+  int sizes[MAXSWEEP];
+  int n_sizes = 0;
+  int measure_latency = FALSE;
+  int report_faults = FALSE;
+  struct rusage self_start, self_end, thread_start, thread_end;
+  char* pool_file = NULL;
+  int restart_halfway = FALSE;
+  int resuming = FALSE;
+  restart_state_t state;
+  double attach_us = 0;
+  int halfway = 0;
+  char* convert_to = NULL;
+  kma_trace_t trace;
+  kma_trace_rec_t* rec;
+  int op = 0;
+  double load_ms, replay_ms;
+  int streaming = FALSE;
+  kma_live_t live;
+  mem_t* requests = NULL;
+  char* allocators = NULL;
+  struct timespec start, end;
+  int n_replicas = 0;
+  int share = FALSE;
+  int opt;
+  
+  while ((opt = getopt(argc, argv, "AFGHILMUVXe:C:D:K:N:R:P:S:T:W:")) != -1)
+    {
+      switch (opt)
+	{
+	case 'A':
+	  page_config()->address_order = TRUE;
+	  break;
+	case 'H':
+	  page_config()->hugepages = TRUE;
+	  break;
+	case 'e':
+	  events = optarg;
+	  break;
+	case 'R':
+	  page_config()->reclaim = TRUE;
+	  page_config()->reclaim_pages = atoi(optarg);
+	  ms = strchr(optarg, ',');
+	  if (ms != NULL)
+	    {
+	      page_config()->reclaim_ms = atoi(ms + 1);
+	    }
+	  break;
+	case 'P':
+	  n_sizes = parse_sizes(optarg, sizes);
+	  break;
+	case 'W':
+	  page_config()->watermarks = TRUE;
+	  if (sscanf(optarg, "%d,%d,%d", &page_config()->wmark_min,
+		     &page_config()->wmark_low, &page_config()->wmark_high) != 3)
+	    {
+	      usage();
+	    }
+	  break;
+	case 'L':
+	  measure_latency = TRUE;
+	  page_config()->op_latency = TRUE;
+	  break;
+	case 'F':
+	  page_config()->prefault = TRUE;
+	  break;
+	case 'M':
+	  page_config()->lock_pages = TRUE;
+	  break;
+	case 'U':
+	  report_faults = TRUE;
+	  break;
+	case 'C':
+	  page_config()->colors = atoi(optarg);
+	  break;
+	case 'S':
+	  pool_file = optarg;
+	  break;
+	case 'T':
+	  convert_to = optarg;
+	  break;
+	case 'I':
+	  streaming = TRUE;
+	  break;
+	case 'K':
+	  allocators = optarg;
+	  break;
+	case 'X':
+	  restart_halfway = TRUE;
+	  break;
+	case 'N':
+	  n_replicas = atoi(optarg);
+	  break;
+	case 'G':
+	  share = TRUE;
+	  break;
+	case 'V':
+	  page_config()->remap_spans = TRUE;
+	  break;
+	case 'D':
+	  page_config()->nodes = atoi(optarg);
+	  ms = strchr(optarg, ',');
+	  if (ms != NULL)
+	    {
+	      page_config()->node_chunks = atoi(ms + 1);
+	    }
+	  break;
+	default:
+	  usage();
+	}
+    }
+  
+  if (argc - optind != 1)
+    {
+      usage();
+    }
+  
+  if (convert_to != NULL)
+    {
+      trace_load(&trace, argv[optind]);
+      trace_save(&trace, convert_to);
+      printf("Trace: wrote %ld operations on %d requests to %s\n",
+	     trace.n_ops, trace.n_req, convert_to);
+      exit(0);
+    }
+  
+  if (restart_halfway && pool_file == NULL)
+    {
+      error("-X needs a heap file", "use -S");
+    }
+  if (restart_halfway && streaming)
+    {
+      error("a restart saves the whole request table", "no -X with -I");
+    }
+  if (pool_file != NULL && n_sizes > 1)
+    {
+      error("a heap file has one page size", "no sweep with -S");
+    }
+  if ((n_replicas > 0 || share) && (pool_file != NULL || n_sizes > 1))
+    {
+      error("replicas cannot be combined", "no -S or page size sweep");
+    }
+#ifdef KMA_REGISTRY
+  if (allocators == NULL)
+    {
+      allocators = "all";
+    }
+  if (pool_file != NULL || n_sizes > 1 || n_replicas > 0 || streaming)
+    {
+      error("a comparison replays one loaded trace",
+	    "no -S, -P list, -N or -I with -K");
+    }
+#else
+  if (allocators != NULL)
+    {
+      error("this build has one allocator", "use kma_all for -K");
+    }
+#endif
+  resuming = (pool_file != NULL && getenv(RESUMEVAR) != NULL);
 #ifdef COMPETITION
-  double ratioSum = 0.0;
-  int ratioCount = 0;
+  // the waste ratio compares the pages in use over the replay with the
+  // bytes asked for
+  page_config()->residency = TRUE;
+#endif
+  if (n_sizes > 1)
+    {
+      page_config()->residency = TRUE;
+    }
+  
+  if (n_sizes == 1)
+    {
+      page_config()->page_size = sizes[0];
+    }
+  else if (n_sizes > 1)
+    {
+      // returns in the child processes only
+      sweep(sizes, n_sizes);
+    }
+#ifdef KMA_REGISTRY
+  // with every allocator linked in, the only thing to do is compare
+  compare(allocators, events, argv[optind]);
 #endif
   
+  if (n_replicas > 0)
+    {
+      // returns in the child processes only
+      replicate(n_replicas, share);
+    }
+  
 #ifndef COMPETITION
-  FILE* allocTrace = fopen("kma_output.dat", "w");
+  // a resumed replay continues the output of the first process,
+  // replicas would only write over each other
+  FILE* allocTrace = fopen(n_replicas > 0 ? "/dev/null" : "kma_output.dat",
+			   resuming ? "a" : "w");
   if (allocTrace == NULL)
     {
       error("unable to open allocation output file", "kma_output.dat");
     }
-  fprintf(allocTrace, "0 0 0\n");
+  if (!resuming)
+    fprintf(allocTrace, "0 0 0\n");
 #endif
-
-  if (argc != 2)
+  
+  // reading the trace is timed apart from the replay, a binary one
+  // is replayed straight from the mapping. A streamed one is read in
+  // batches during the replay, which keeps only the live requests
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (streaming)
+    trace_open(&trace, argv[optind]);
+  else
+    trace_load(&trace, argv[optind]);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  load_ms = (end.tv_sec - start.tv_sec) * 1e3
+    + (end.tv_nsec - start.tv_nsec) / 1e6;
+  n_req = trace.n_req;
+  
+  if (streaming)
     {
-      usage();
+      live_init(&live);
     }
-  
-  FILE* f_test = fopen(argv[1], "r");
-  if (f_test == NULL)
+  else
     {
-      error("unable to open input test file", argv[1]);
+      requests = malloc((n_req + 1)*sizeof(mem_t));
+      memset(requests, 0, (n_req + 1)*sizeof(mem_t));
     }
   
-  // Get the number of requests in the trace file
-  // Allocate some memory...
-  int status = fscanf(f_test, "%d\n", &n_req);
-  if(status != 1)
-    error("Couldn't read number of requests at head of file", "");
-  
-  mem_t* requests = malloc((n_req + 1)*sizeof(mem_t));
-  memset(requests, 0, (n_req + 1)*sizeof(mem_t));
+  hist_init();
   
-  char command[16];
-  int req_id, req_size, index = 1;
+  int index = 1;
 
-  // Parse the lines in the file, and call allocate or
-  // deallocate accordingly.
-  //double malloc_cpu_time_used = 0;
-  //double free_cpu_time_used = 0;
-  //double malloc_worst_latency = 0;
-  //double free_worst_latency = 0;
-  //double malloc_total_size = 0;
-  //double round_total_size = 0;
-  while (fscanf(f_test, "%10s", command) == 1)
+  if (pool_file != NULL)
     {
-      if (strcmp(command, "REQUEST") == 0)
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      if (!kma_attach(pool_file) && resuming)
 	{
-	  
-	  if (fscanf(f_test, "%d %d", &req_id, &req_size) != 2)
-	    error("Not enough arguments to REQUEST", "");
-
-	  assert(req_id >= 0 && req_id < n_req);
-	  //clock_t start = clock();
-	  allocate(requests, req_id, req_size);
-    //malloc_total_size += (double)(req_size);
-    //clock_t end = clock();
-    //malloc_cpu_time_used += ((double) (end - start)) / CLOCKS_PER_SEC;
-    //if(malloc_worst_latency < ((double) (end - start)) / CLOCKS_PER_SEC)
-	  //   malloc_worst_latency = ((double) (end - start)) / CLOCKS_PER_SEC;
-    n_alloc++;
+	  error("no heap to resume in", pool_file);
 	}
-      else if (strcmp(command, "FREE") == 0)
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      attach_us = (end.tv_sec - start.tv_sec) * 1e6
+	+ (end.tv_nsec - start.tv_nsec) / 1e3;
+      
+      if (resuming)
 	{
-	  if (fscanf(f_test, "%d", &req_id) != 1)
-	    error("Not enough arguments to FREE", "");
-	  
-	  assert(req_id >= 0 && req_id < n_req);
-	  
-    //clock_t start = clock();
-	  deallocate(requests, req_id);
-    //clock_t end = clock();
-    //free_cpu_time_used += ((double) (end - start)) / CLOCKS_PER_SEC;
-    //round_total_size += find_rounded_size(req_size);
-    //if(free_worst_latency < ((double) (end - start)) / CLOCKS_PER_SEC)
-	  //    free_worst_latency = ((double) (end - start)) / CLOCKS_PER_SEC;
-    n_dealloc++;
+	  resume(pool_file, requests, n_req, &state);
+	  op = state.offset;
+	  n_alloc = state.n_alloc;
+	  n_dealloc = state.n_dealloc;
+	  index = state.index;
+	  liveByteOps = state.live_byte_ops;
 	}
-      else
+      else if (restart_halfway)
 	{
-	  error("unknown command type:", command);
+	  halfway = trace.n_ops / 2;
 	}
-
-      stat = page_stats();
-      int totalBytes = stat->num_in_use * stat->page_size;
-
+    }
+  
+  if (events != NULL)
+    {
+      perf_open(&perf, events);
+      op_perf = &perf;
+      perf_start(&perf);
+    }
+  if (report_faults)
+    {
+      getrusage(RUSAGE_SELF, &self_start);
+      getrusage(RUSAGE_THREAD, &thread_start);
+    }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (;; op++)
+    {
+      if (op == trace.n_recs)
+	{
+	  if (trace_next(&trace) == 0)
+	    break;
+	  op = 0;
+	}
+      rec = &trace.recs[op];
       
-#ifdef COMPETITION
-      if(req_id < n_req && n_alloc != n_dealloc)
+      // one tick per record for the page layer's residency too, so the
+      // waste ratio does not depend on the speed of the replay
+      page_tick();
+      liveByteOps += currentAllocBytes;
+      
+      if (TRACE_ISFREE(rec))
 	{
-	  // We can calculate the ratio of wasted to used memory here.
-
-	  int wastedBytes = totalBytes - currentAllocBytes;
-	  ratioSum += ((double) wastedBytes) / currentAllocBytes;
-	  ratioCount += 1;
+	  if (streaming)
+	    deallocate_live(&live, TRACE_ID(rec));
+	  else
+	    deallocate(requests, TRACE_ID(rec));
+	  n_dealloc++;
+	}
+      else
+	{
+	  if (streaming)
+	    allocate_live(&live, TRACE_ID(rec), rec->size);
+	  else
+	    allocate(requests, TRACE_ID(rec), rec->size);
+	  n_alloc++;
 	}
-#endif
 
 #ifndef COMPETITION
-      fprintf(allocTrace, "%d %d %d\n", index, currentAllocBytes, totalBytes);
+      fprintf(allocTrace, "%d %d %d\n", index, currentAllocBytes,
+	      page_in_use() * PAGESIZE);
 #endif
       
       index += 1;
+      
+      if (halfway > 0 && op + 1 >= halfway)
+	{
+	  clock_gettime(CLOCK_MONOTONIC, &end);
+#ifndef COMPETITION
+	  fclose(allocTrace);
+#endif
+	  state.offset = op + 1;
+	  state.n_alloc = n_alloc;
+	  state.n_dealloc = n_dealloc;
+	  state.index = index;
+	  state.live_byte_ops = liveByteOps;
+	  state.first_ms = (end.tv_sec - start.tv_sec) * 1e3
+	    + (end.tv_nsec - start.tv_nsec) / 1e6;
+	  printf("Restart: replayed %d requests in %.1f ms, heap attached "
+		 "in %.1f us\n", n_alloc + n_dealloc, state.first_ms, attach_us);
+	  restart(argv, pool_file, requests, n_req, &state);
+	}
+    }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (events != NULL)
+    {
+      perf_stop(&perf);
+    }
+  if (report_faults)
+    {
+      getrusage(RUSAGE_SELF, &self_end);
+      getrusage(RUSAGE_THREAD, &thread_end);
     }
-  //printf("Total Request time is: %f\n", malloc_cpu_time_used * 1000);
-  //printf("Total Free time is: %f\n", free_cpu_time_used * 1000);
-  //printf("Worst Request latency is: %f\n", malloc_worst_latency * 1000);
-  //printf("Worst Free latency is: %f\n", free_worst_latency * 1000);
-  //printf("Malloc Total Size is: %f\n", malloc_total_size); 
-  //printf("Round Total Size is: %f\n", round_total_size); 
-  //double ratio = malloc_total_size / round_total_size;
-  //printf("Ratio is: %f\n", ratio); 
+  // without the batches read on the way
+  replay_ms = (end.tv_sec - start.tv_sec) * 1e3
+    + (end.tv_nsec - start.tv_nsec) / 1e6 - trace.read_ms;
 
 #ifndef COMPETITION
   fclose(allocTrace);
@@ -260,9 +567,109 @@ main(int argc, char* argv[])
   
   stat = page_stats();
   
+  printf("Trace: %ld operations %s in %.1f ms, replayed in %.1f ms\n",
+	 trace.n_ops, streaming ? "streamed" : trace.binary ? "mapped"
+	 : "parsed", load_ms + trace.read_ms, replay_ms);
+  trace_unload(&trace);
+  
+  if (streaming)
+    {
+      printf("Live requests: at most %d at once, table of %ld KB instead "
+	     "of one entry per request id\n", live.max_num,
+	     live_bytes(&live) / 1024);
+      live_free(&live);
+    }
+  
   printf("Page Requested/Freed/In Use: %5d/%5d/%5d\n",
 	 stat->num_requested, stat->num_freed, stat->num_in_use);
   
+  if (page_config()->hugepages)
+    {
+      printf("Pool backing: %s\n",
+	     stat->backing == PAGE_BACKING_HUGETLB ? "hugetlbfs pages" :
+	     stat->backing == PAGE_BACKING_THP ? "transparent huge pages" :
+	     "base pages (no huge pages available)");
+    }
+  
+  if (page_config()->reclaim)
+    {
+      printf("Pool pages resident/reclaimed: %5d/%5d, given back %d pages "
+	     "and %d chunks\n", stat->num_resident, stat->num_reclaimed,
+	     stat->num_reclaims, stat->num_releases);
+    }
+  
+  if (stat->num_shrinks > 0)
+    {
+      printf("Pool ran out %d times, the allocator gave back %d pages\n",
+	     stat->num_shrinks, stat->num_shrunk);
+    }
+  
+  if (page_config()->lock_pages)
+    {
+      printf("Pool pages locked: %5d\n", stat->num_locked);
+    }
+  
+  if (stat->num_nodes > 1)
+    {
+      print_nodes(stat);
+    }
+  
+  if (n_large > 0)
+    {
+      printf("Large requests served/refused: %5d/%5d, pool chunks at "
+	     "peak: %d\n", n_large - n_refused, n_refused,
+	     stat->num_peak_chunks);
+    }
+  
+  if (page_config()->residency)
+    {
+      printf("Pages in use at peak: %5d, residency %.0f page-ops, waste "
+	     "ratio %.4f\n", stat->num_peak, stat->page_ops,
+	     waste_ratio(stat, liveByteOps));
+    }
+  else
+    {
+      printf("Pages in use at peak: %5d\n", stat->num_peak);
+    }
+  
+  if (resuming)
+    {
+      // rebuilding the heap without the file would mean replaying the
+      // first part again
+      printf("Restart: heap reopened in %.1f us instead of replaying "
+	     "%.1f ms, then replayed the rest in %.1f ms\n", attach_us,
+	     state.first_ms, replay_ms);
+    }
+  
+  print_latency(measure_latency);
+  if (measure_latency)
+    {
+      print_page_latency("get_page", stat->get_latency);
+      print_page_latency("free_page", stat->free_latency);
+    }
+  
+  if (report_faults)
+    {
+      // the replay thread takes the faults on the allocation path, the
+      // process total includes background threads of the page layer
+      printf("Page faults minor/major: replay thread %ld/%ld, "
+	     "process %ld/%ld\n",
+	     thread_end.ru_minflt - thread_start.ru_minflt,
+	     thread_end.ru_majflt - thread_start.ru_majflt,
+	     self_end.ru_minflt - self_start.ru_minflt,
+	     self_end.ru_majflt - self_start.ru_majflt);
+    }
+  
+  if (events != NULL)
+    {
+      perf_print(&perf, "Perf counter: ");
+      merge_classes(malloc_hist, &all);
+      perf_print_per(&perf, "kma_malloc:", malloc_counts, all.count);
+      merge_classes(free_hist, &all);
+      perf_print_per(&perf, "kma_free:", free_counts, all.count);
+      perf_close(&perf);
+    }
+  
 
   if (stat->num_requested != stat->num_freed || stat->num_in_use != 0)
     {
@@ -275,13 +682,369 @@ main(int argc, char* argv[])
     }
 
 #ifdef COMPETITION
-  printf("Competition average ratio: %f\n", ratioSum / ratioCount);
+  printf("Competition average ratio: %f\n", waste_ratio(stat, liveByteOps));
 #endif
   
+  if (sweep_fd >= 0)
+    {
+      sweep_result_t result;
+      
+      result.time_ms = replay_ms;
+      result.ratio = waste_ratio(stat, liveByteOps);
+      result.n_ops = n_alloc + n_dealloc;
+      if (write(sweep_fd, &result, sizeof(result)) != sizeof(result))
+	error("unable to report sweep result", "");
+    }
+  
   pass();
   return 0;
 }
 
+/***********************************************************************
+ *  Title: Concurrent replicas
+ * ---------------------------------------------------------------------
+ *    Purpose: Replays the trace in n processes at the same time, each
+ *             with a private page pool or, with share set, all on one
+ *             pool in shared memory (share_pool()). Each allocator
+ *             heap stays private to its process either way. The
+ *             children report back like the sweep children, the
+ *             parent prints the aggregate throughput and exits
+ *    Input: the number of processes, whether they share the pool
+ *    Output: none (returns in the children only)
+ ***********************************************************************/
+void
+replicate(int n, int share)
+{
+  sweep_result_t result;
+  struct timespec start, end;
+  double wall_ms, slowest = 0;
+  int failed = 0;
+  long n_ops = 0;
+  int fds[MAXREPLICAS][2];
+  pid_t pids[MAXREPLICAS];
+  int status;
+  int i;
+  
+  if (n > MAXREPLICAS)
+    {
+      error("too many replicas", "");
+    }
+  if (share)
+    {
+      share_pool(NULL);
+    }
+  
+  fflush(stdout);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < n; i++)
+    {
+      if (pipe(fds[i]) != 0 || (pids[i] = fork()) < 0)
+	{
+	  error("unable to start replica process", "");
+	}
+      if (pids[i] == 0)
+	{
+	  close(fds[i][0]);
+	  sweep_fd = fds[i][1];
+	  if (freopen("/dev/null", "w", stdout) == NULL)
+	    error("unable to silence replica process", "");
+	  return;
+	}
+      close(fds[i][1]);
+    }
+  
+  for (i = 0; i < n; i++)
+    {
+      if (read(fds[i][0], &result, sizeof(result)) != sizeof(result))
+	{
+	  result.time_ms = -1;
+	}
+      close(fds[i][0]);
+      waitpid(pids[i], &status, 0);
+      
+      if (result.time_ms < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+	  failed = 1;
+	  continue;
+	}
+      n_ops += result.n_ops;
+      if (result.time_ms > slowest)
+	slowest = result.time_ms;
+    }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  wall_ms = (end.tv_sec - start.tv_sec) * 1e3
+    + (end.tv_nsec - start.tv_nsec) / 1e6;
+  
+  if (failed)
+    {
+      fail();
+    }
+  printf("Replicas: %d on %s, %.1f ms wall, slowest replay %.1f ms, "
+	 "%.0f requests/s\n", n, share ? "one shared pool" : "private pools",
+	 wall_ms, slowest, n_ops / (wall_ms / 1e3));
+  pass();
+}
+
+/***********************************************************************
+ *  Title: Restarts the replay halfway
+ * ---------------------------------------------------------------------
+ *    Purpose: Saves the request table, the contents the live requests
+ *             should have and the replay counters next to the heap
+ *             file, detaches the heap and executes the test again with
+ *             RESUMEVAR set, so that a fresh process reopens the heap
+ *             and goes on with the rest of the trace
+ *    Input: the arguments to execute again, the heap file, the request
+ *           table and its length, the replay counters
+ *    Output: none, does not return
+ ***********************************************************************/
+void
+restart(char* argv[], char* pool_file, mem_t* requests, int n_req,
+	restart_state_t* state)
+{
+  char path[4096];
+  FILE* f;
+  int i;
+  
+  // the pool's counters stop here, like the live bytes in state
+  detach_pool();
+  
+  snprintf(path, sizeof(path), "%s.replay", pool_file);
+  f = fopen(path, "w");
+  if (f == NULL)
+    {
+      error("unable to save the replay", path);
+    }
+  
+  state->val = val;
+  state->alloc_bytes = currentAllocBytes;
+  fwrite(state, sizeof(restart_state_t), 1, f);
+  // ptr points into the heap file, which is mapped at the same address
+  fwrite(requests, sizeof(mem_t), n_req + 1, f);
+  for (i = 0; i <= n_req; i++)
+    {
+      if (requests[i].state == USED && requests[i].value != NULL)
+	fwrite(requests[i].value, requests[i].size, 1, f);
+    }
+  if (fclose(f) != 0)
+    {
+      error("unable to save the replay", path);
+    }
+  
+  fflush(stdout);
+  setenv(RESUMEVAR, "1", 1);
+  execv("/proc/self/exe", argv);
+  error("unable to restart", argv[0]);
+}
+
+// loads what restart() saved, the replay goes on from state->offset
+void
+resume(char* pool_file, mem_t* requests, int n_req, restart_state_t* state)
+{
+  char path[4096];
+  FILE* f;
+  int i;
+  
+  unsetenv(RESUMEVAR);
+  snprintf(path, sizeof(path), "%s.replay", pool_file);
+  f = fopen(path, "r");
+  if (f == NULL)
+    {
+      error("unable to load the replay", path);
+    }
+  
+  if (fread(state, sizeof(restart_state_t), 1, f) != 1
+      || fread(requests, sizeof(mem_t), n_req + 1, f) != n_req + 1)
+    {
+      error("replay file is truncated", path);
+    }
+  for (i = 0; i <= n_req; i++)
+    {
+      if (requests[i].state == USED && requests[i].value != NULL)
+	{
+	  requests[i].value = malloc(requests[i].size);
+	  assert(requests[i].value != NULL);
+	  if (fread(requests[i].value, requests[i].size, 1, f) != 1)
+	    error("replay file is truncated", path);
+	}
+    }
+  fclose(f);
+  unlink(path);
+  
+  val = state->val;
+  currentAllocBytes = state->alloc_bytes;
+}
+
+#ifdef KMA_REGISTRY
+/***********************************************************************
+ *  Title: Compares allocators
+ * ---------------------------------------------------------------------
+ *    Purpose: Replays the trace against each allocator of the comma
+ *             separated list, or all of them, one after the other in
+ *             this process from the same parsed trace. An untimed
+ *             replay with the first one maps and faults in the pool
+ *             beforehand, so that it does not pay for that alone. The
+ *             page statistics start over for every allocator. Prints
+ *             one row per allocator, then with events the counts of
+ *             each kma_malloc and kma_free
+ *    Input: the list, the events or NULL, the path of the trace
+ *    Output: none, does not return
+ ***********************************************************************/
+void
+compare(char* list, char* events, char* path)
+{
+  kma_allocator_t* chosen[MAXALLOCATORS];
+  long long counts[MAXALLOCATORS][2][PERF_MAXCOUNTERS];
+  unsigned long long n_ops[MAXALLOCATORS][2];
+  kma_perf_t perf, perfs[MAXALLOCATORS];
+  char label[64];
+  kma_allocator_t* a;
+  kma_page_stat_t* stat;
+  kma_hist_t all_malloc, all_free;
+  kma_trace_t trace;
+  mem_t* requests;
+  double ms, live_byte_ops;
+  char* name;
+  int n = 0;
+  int i;
+  
+  if (strcmp(list, "all") == 0)
+    {
+      for (i = 0; kma_allocators[i] != NULL && n < MAXALLOCATORS; i++)
+	chosen[n++] = kma_allocators[i];
+    }
+  else
+    {
+      for (name = strtok(list, ","); name != NULL && n < MAXALLOCATORS;
+	   name = strtok(NULL, ","))
+	{
+	  if ((chosen[n++] = registry_find(name)) == NULL)
+	    error("no allocator named", name);
+	}
+    }
+  if (n == 0)
+    {
+      error("no allocators to compare", list);
+    }
+  
+  trace_load(&trace, path);
+  requests = calloc(trace.n_req + 1, sizeof(mem_t));
+  assert(requests != NULL);
+  hist_init();
+  
+  registry_use(chosen[0]);
+  replay_trace(&trace, requests, &live_byte_ops);
+  kma_reset();
+  if (events != NULL && perf_open(&perf, events) == 0)
+    {
+      printf("Perf counters: none available (%s)\n", strerror(perf.errs[0]));
+    }
+  if (events != NULL)
+    {
+      op_perf = &perf;
+    }
+  
+  printf("%-10s %10s %8s %17s %17s %10s %11s %8s\n", "Allocator",
+	 "Time (ms)", "Mops/s", "malloc p50/p99", "free p50/p99",
+	 "Peak pages", "Waste ratio", "Refused");
+  for (i = 0; i < n; i++)
+    {
+      a = chosen[i];
+      registry_use(a);
+      page_reset_stats();
+      memset(malloc_hist, 0, sizeof(malloc_hist));
+      memset(free_hist, 0, sizeof(free_hist));
+      memset(malloc_counts, 0, sizeof(malloc_counts));
+      memset(free_counts, 0, sizeof(free_counts));
+      if (events != NULL)
+	{
+	  memset(perf.values, 0, sizeof(perf.values));
+	  memset(perf.raw, 0, sizeof(perf.raw));
+	  perf_start(&perf);
+	}
+      
+      ms = replay_trace(&trace, requests, &live_byte_ops);
+      if (events != NULL)
+	{
+	  perf_stop(&perf);
+	}
+      
+      stat = page_stats();
+      if (stat->num_in_use != 0)
+	{
+	  error("not all pages freed by", a->name);
+	}
+      kma_reset();
+      
+      merge_classes(malloc_hist, &all_malloc);
+      merge_classes(free_hist, &all_free);
+      printf("%-10s %10.1f %8.2f %8.0f/%-8.0f %8.0f/%-8.0f %10d %11.4f %8d\n",
+	     a->name, ms, trace.n_ops / ms / 1e3,
+	     hist_percentile(&all_malloc, 0.5),
+	     hist_percentile(&all_malloc, 0.99),
+	     hist_percentile(&all_free, 0.5), hist_percentile(&all_free, 0.99),
+	     stat->num_peak, waste_ratio(stat, live_byte_ops),
+	     a->stats.num_refused);
+      
+      perfs[i] = perf;
+      memcpy(counts[i][0], malloc_counts, sizeof(malloc_counts));
+      memcpy(counts[i][1], free_counts, sizeof(free_counts));
+      n_ops[i][0] = all_malloc.count;
+      n_ops[i][1] = all_free.count;
+    }
+  
+  for (i = 0; i < n && events != NULL; i++)
+    {
+      snprintf(label, sizeof(label), "%s kma_malloc:", chosen[i]->name);
+      perf_print_per(&perfs[i], label, counts[i][0], n_ops[i][0]);
+      snprintf(label, sizeof(label), "%s kma_free:", chosen[i]->name);
+      perf_print_per(&perfs[i], label, counts[i][1], n_ops[i][1]);
+    }
+  if (events != NULL)
+    {
+      perf_close(&perf);
+      op_perf = NULL;
+    }
+  
+  trace_unload(&trace);
+  free(requests);
+  
+  if (anyMismatches)
+    {
+      error("there were memory mismatches", "");
+    }
+  pass();
+}
+
+// one replay of a loaded trace from the start, returns the time it took
+// in ms. The request table is empty again at the end
+double
+replay_trace(kma_trace_t* trace, mem_t* requests, double* live_byte_ops)
+{
+  struct timespec start, end;
+  kma_trace_rec_t* rec;
+  long op;
+  
+  *live_byte_ops = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (op = 0; op < trace->n_ops; op++)
+    {
+      rec = &trace->recs[op];
+      
+      page_tick();
+      *live_byte_ops += currentAllocBytes;
+      
+      if (TRACE_ISFREE(rec))
+	deallocate(requests, TRACE_ID(rec));
+      else
+	allocate(requests, TRACE_ID(rec), rec->size);
+    }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  
+  return (end.tv_sec - start.tv_sec) * 1e3
+    + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+#endif
+
 void
 fail()
 {
@@ -296,9 +1059,133 @@ pass()
   exit(0);
 }
 
+// parses a comma separated list of page sizes, returns how many
+int
+parse_sizes(char* list, int sizes[])
+{
+  int n = 0;
+  char* size;
+  
+  for (size = strtok(list, ","); size != NULL; size = strtok(NULL, ","))
+    {
+      if (n == MAXSWEEP)
+	{
+	  error("too many page sizes", list);
+	}
+      sizes[n++] = atoi(size);
+    }
+  
+  return n;
+}
+
+/***********************************************************************
+ *  Title: Page size sweep
+ * ---------------------------------------------------------------------
+ *    Purpose: Replays the trace once per page size. The page size is
+ *             fixed for the life of a pool, so every replay runs in a
+ *             child process that reports its time and waste ratio
+ *             back over a pipe. The parent prints one row per size
+ *             and exits, the children return and do the replay
+ *    Input: the page sizes and their number
+ *    Output: none (returns in the children only)
+ ***********************************************************************/
+void
+sweep(int sizes[], int n)
+{
+  sweep_result_t result;
+  int failed = 0;
+  int fds[2];
+  int status;
+  pid_t pid;
+  int i;
+  
+  printf("%10s %12s %12s %s\n", "Page size", "Time (ms)", "Waste ratio",
+	 "Result");
+  for (i = 0; i < n; i++)
+    {
+      fflush(stdout);
+      if (pipe(fds) != 0 || (pid = fork()) < 0)
+	{
+	  error("unable to start sweep process", "");
+	}
+      if (pid == 0)
+	{
+	  close(fds[0]);
+	  sweep_fd = fds[1];
+	  page_config()->page_size = sizes[i];
+	  if (freopen("/dev/null", "w", stdout) == NULL)
+	    error("unable to silence sweep process", "");
+	  return;
+	}
+      
+      close(fds[1]);
+      if (read(fds[0], &result, sizeof(result)) != sizeof(result))
+	{
+	  result.time_ms = -1;
+	}
+      close(fds[0]);
+      waitpid(pid, &status, 0);
+      
+      if (result.time_ms >= 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+	{
+	  printf("%10d %12.1f %12.4f PASS\n", sizes[i], result.time_ms,
+		 result.ratio);
+	}
+      else
+	{
+	  printf("%10d %12s %12s FAILED\n", sizes[i], "-", "-");
+	  failed = 1;
+	}
+    }
+  
+  if (failed)
+    {
+      fail();
+    }
+  pass();
+}
+
 void
 usage() {
-  printf("Usage: %s traceFile\n", name);
+  printf("Usage: %s [-AFGHILMUVX] [-R pages[,ms]] [-W min,low,high] [-P size,...]\n"
+	 "          [-C colors] [-D nodes[,chunks]] [-S heap file] [-N procs]\n"
+	 "          [-e event,...] [-T binary trace] [-K allocator,...]\n"
+	 "          traceFile\n"
+	 "  -A  hand out the lowest free page of the pool, not the most\n"
+	 "      recently freed one\n"
+	 "  -F  fault in every pool chunk when it is mapped\n"
+	 "  -M  fault in and lock every pool chunk in memory\n"
+	 "  -U  report the page faults taken during the replay\n"
+	 "  -L  report kma_malloc/kma_free latency by request size and\n"
+	 "      page operation latency percentiles\n"
+	 "  -H  back the page pool with huge pages if possible\n"
+	 "  -R  give free pages back to the OS once more than pages of\n"
+	 "      them (or any free for ms milliseconds) are resident\n"
+	 "  -W  keep between low and high faulted-in free pages ready in\n"
+	 "      a background thread, refill inline below min\n"
+	 "  -P  use this page size, or replay once per size in the list\n"
+	 "      and report time and waste ratio for each\n"
+	 "  -C  spread the allocators' page headers over this many cache\n"
+	 "      line colors, 1 to keep them at the start of the page\n"
+	 "  -D  split the pool into this many fake memory nodes, each\n"
+	 "      mapping at most chunks chunks before it spills\n"
+	 "  -S  keep the heap in this file, reopen it if it holds one\n"
+	 "  -X  with -S, stop halfway and finish the trace in a new\n"
+	 "      process that reopens the heap\n"
+	 "  -N  replay in this many processes at once and report the\n"
+	 "      aggregate throughput\n"
+	 "  -G  with -N, let the processes share one page pool\n"
+	 "  -V  serve requests larger than a page from scattered pages\n"
+	 "      mapped into a contiguous range\n"
+	 "  -I  read the trace in batches while replaying and keep only\n"
+	 "      the live requests, for traces larger than memory\n"
+	 "  -K  with every allocator linked in (kma_all), replay the\n"
+	 "      trace with each of these, or all, and compare them\n"
+	 "  -T  write the trace in the binary format to this file and\n"
+	 "      exit, replaying that file skips parsing\n"
+	 "  -e  count events around the replay and per kma_malloc/kma_free,\n"
+	 "      which slows it down (%s,\n"
+	 "      or default for the hardware ones)\n", name, perf_events());
   exit(0);
 }
 
@@ -316,40 +1203,196 @@ allocate(mem_t* requests, int req_id, int req_size)
   assert(new->state == FREE);
   
   new->size = req_size;
-  new->ptr = kma_malloc(new->size);
+  new->ptr = alloc_block(req_size, &new->value);
+  new->state = (new->ptr != NULL) ? USED : REFUSED;
+}
+
+// allocate for a streamed replay, which keeps live requests only
+void
+allocate_live(kma_live_t* live, unsigned int req_id, int req_size)
+{
+  int slot = live_add(live, req_id);
+  
+  live->sizes[slot] = req_size;
+  live->ptrs[slot] = alloc_block(req_size, &live->values[slot]);
+}
+
+// kma_malloc with the checks on the memory, NULL if the allocator
+// refused the request. value gets the copy of the contents
+void*
+alloc_block(int size, void** value)
+{
+  kma_hist_t* hist = &malloc_hist[size_class(size)];
+  long long counts[PERF_MAXCOUNTERS];
+  kma_tick_t start;
+  void* ptr;
+  
+  // the counters outside the timed part, reading them takes longer
+  if (op_perf != NULL)
+    perf_read(op_perf, counts);
+  start = hist_ticks();
+  ptr = kma_malloc(size);
+  hist_add(hist, start);
+  if (op_perf != NULL)
+    perf_add(op_perf, malloc_counts, counts);
   
-  // Accept a NULL response in some cases... 
-  if(!(((new->ptr != NULL) && (new->size <= (PAGESIZE - sizeof(void*))))
-       || ((new->ptr == NULL) && (new->size > (PAGESIZE - sizeof(void*))))))
+  // Accept a NULL response in some cases... requests larger than a
+  // page may be served from a span of pages or be refused
+  if((ptr == NULL) && (size <= (PAGESIZE - sizeof(void*))))
     {
       error("got NULL from kma_malloc for alloc'able request", "");
     }
   
-  if (new->ptr == NULL)
+  if (size > PAGESIZE - sizeof(void*))
     {
-      return;
+      n_large++;
+    }
+  if (ptr == NULL)
+    {
+      n_refused++;
+      return NULL;
     }
 
-  currentAllocBytes += req_size;
+  currentAllocBytes += size;
   
 #ifndef COMPETITION
   // Only run the actual memory accesses/copies/checks if we're
   // testing for correctness.
   
-  new->value = malloc(new->size);
-  assert(new->value != NULL);
+  *value = malloc(size);
+  assert(*value != NULL);
   
   // initialize memory
-  fill((char*)new->ptr, new->size);
+  fill((char*)ptr, size);
   
   // copy the value for further reference
-  bcopy(new->ptr, new->value, new->size);
+  bcopy(ptr, *value, size);
   
-  check((char*)new->ptr, (char*)new->value, new->size);
+  check((char*)ptr, (char*)*value, size);
   
 #endif
 
-  new->state = USED;
+  return ptr;
+}
+
+// the latency histogram class of a request
+int
+size_class(int size)
+{
+  int c;
+  
+  for (c = 0; c < SIZECLASSES - 2; c++)
+    {
+      if (size <= class_bytes[c])
+	return c;
+    }
+  
+  return (size <= PAGESIZE - sizeof(void*)) ? SIZECLASSES - 2
+    : SIZECLASSES - 1;
+}
+
+// kma_malloc and kma_free latency over all requests, by_class for
+// every size class too
+void
+print_latency(int by_class)
+{
+  kma_hist_t* hists[2] = { malloc_hist, free_hist };
+  char* ops[2] = { "kma_malloc", "kma_free" };
+  kma_hist_t all;
+  char label[64];
+  int i, c;
+  
+  for (i = 0; i < 2; i++)
+    {
+      merge_classes(hists[i], &all);
+      hist_print(&all, ops[i]);
+      
+      for (c = 0; by_class && c < SIZECLASSES; c++)
+	{
+	  if (c < SIZECLASSES - 2)
+	    snprintf(label, sizeof(label), "%s <=%dB", ops[i], class_bytes[c]);
+	  else
+	    snprintf(label, sizeof(label), "%s %s", ops[i],
+		     (c == SIZECLASSES - 2) ? "<=page" : ">page");
+	  hist_print(&hists[i][c], label);
+	}
+    }
+}
+
+// all size classes of an operation in one histogram
+void
+merge_classes(kma_hist_t hists[], kma_hist_t* all)
+{
+  int c;
+  
+  memset(all, 0, sizeof(kma_hist_t));
+  for (c = 0; c < SIZECLASSES; c++)
+    {
+      hist_merge(all, &hists[c]);
+    }
+}
+
+// percentiles from a log2 histogram of the page layer, as bucket bounds
+void
+print_page_latency(char* op, unsigned int histogram[])
+{
+  double total = 0, seen = 0;
+  double want[] = { 0.5, 0.99, 0.999, 1.0 };
+  int bound[4];
+  int b, p = 0;
+  
+  for (b = 0; b < PAGE_LATBUCKETS; b++)
+    {
+      total += histogram[b];
+    }
+  if (total == 0)
+    {
+      return;
+    }
+  
+  for (b = 0; b < PAGE_LATBUCKETS && p < 4; b++)
+    {
+      seen += histogram[b];
+      while (p < 4 && seen >= want[p] * total)
+	{
+	  bound[p++] = 2 << b;
+	}
+    }
+  
+  printf("%s latency p50/p99/p99.9/max (ns, below): %d/%d/%d/%d\n", op,
+	 bound[0], bound[1], bound[2], bound[3]);
+}
+
+// chunks and spilled pages per memory node
+void
+print_nodes(kma_page_stat_t* stat)
+{
+  int spills = 0;
+  int i;
+  
+  for (i = 0; i < stat->num_nodes; i++)
+    {
+      printf("Node %d: %4d chunks, %5d pages spilled to other nodes\n", i,
+	     stat->node_chunks[i], stat->node_spills[i]);
+      spills += stat->node_spills[i];
+    }
+  printf("Remote spill rate: %.4f\n", (double) spills / stat->num_requested);
+}
+
+// resident bytes beyond the bytes asked for, relative to those, both
+// summed over the trace records: a heap that holds on to memory for
+// long stretches scores worse than one that only peaks briefly
+double
+waste_ratio(kma_page_stat_t* stat, double live_byte_ops)
+{
+  double page_byte_ops = stat->page_ops * stat->page_size;
+  
+  if (live_byte_ops <= 0)
+    {
+      return 0;
+    }
+  
+  return (page_byte_ops - live_byte_ops) / live_byte_ops;
 }
 
 void
@@ -357,24 +1400,62 @@ deallocate(mem_t* requests, int req_id)
 {
   mem_t* cur = &requests[req_id];
   
+  if (cur->state == REFUSED)
+    {
+      cur->state = FREE;
+      return;
+    }
+  
   assert(cur->state == USED);
   assert(cur->size > 0);
   
+  free_block(cur->ptr, cur->size, cur->value);
+  cur->state = FREE;
+}
+
+void
+deallocate_live(kma_live_t* live, unsigned int req_id)
+{
+  int slot = live_find(live, req_id);
+  
+  if (slot < 0)
+    {
+      error("free of a request that is not live", "");
+    }
+  
+  if (live->ptrs[slot] != NULL)
+    {
+      free_block(live->ptrs[slot], live->sizes[slot], live->values[slot]);
+    }
+  live_remove(live, slot);
+}
+
+// kma_free after checking the memory still holds what was written
+void
+free_block(void* ptr, int size, void* value)
+{
+  long long counts[PERF_MAXCOUNTERS];
+  kma_tick_t start;
+  
 #ifndef COMPETITION
   // Only run the memory checks if we're testing for correctness.
 
   // check memory
-  check((char*)cur->ptr, (char*)cur->value, cur->size);
+  check((char*)ptr, (char*)value, size);
 
   // free memory
-  free(cur->value);
+  free(value);
 #endif
 
-  kma_free(cur->ptr, cur->size);
+  if (op_perf != NULL)
+    perf_read(op_perf, counts);
+  start = hist_ticks();
+  kma_free(ptr, size);
+  hist_add(&free_hist[size_class(size)], start);
+  if (op_perf != NULL)
+    perf_add(op_perf, free_counts, counts);
 
-  currentAllocBytes -= cur->size;
-  
-  cur->state = FREE;
+  currentAllocBytes -= size;
 }
 
 void
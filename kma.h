@@ -72,8 +72,43 @@
 #define EXTERN extern
 #endif
 
+/* the entry points below. An allocator built into the registry program
+   (-DKMA_REGISTRY) keeps them static, next to its helpers, and is
+   reached only through its kma_<name>_allocator */
+#undef KMA_ENTRY
+#if defined(__KMA_IMPL__) && defined(KMA_REGISTRY)
+#define KMA_ENTRY static
+#else
+#define KMA_ENTRY EXTERN
+#endif
+
 typedef int kma_size_t;
 
+/* counted by the registry (kma_registry.h) as it dispatches */
+typedef struct
+{
+  int num_malloc;
+  int num_free;
+  int num_refused;       /* kma_malloc returned NULL */
+  long bytes_in_use;
+  long peak_bytes;
+} kma_alloc_stat_t;
+
+/* an allocator as a set of entry points, each allocator defines one
+   named kma_<name>_allocator so that several can be linked into one
+   program (see the kma_all target). There is no stats entry: the
+   registry counts for every allocator alike as it dispatches, into
+   the stats kept here */
+typedef struct
+{
+  char* name;
+  void* (*malloc)(kma_size_t);
+  void (*free)(void*, kma_size_t);
+  int (*attach)(char*);
+  void (*reset)();
+  kma_alloc_stat_t stats;
+} kma_allocator_t;
+
 /************Global Variables*********************************************/
 
 /************Function Prototypes******************************************/
@@ -87,7 +122,7 @@ typedef int kma_size_t;
  *    Output: the allocated memory of the specified size
  *            or NULL on failure
  ***********************************************************************/
-EXTERN void* kma_malloc(kma_size_t size);
+KMA_ENTRY void* kma_malloc(kma_size_t size);
 
 /***********************************************************************
  *  Title: Frees kernel memory spaced
@@ -98,7 +133,32 @@ EXTERN void* kma_malloc(kma_size_t size);
  *           space
  *    Output: none
  ***********************************************************************/
-EXTERN void kma_free(void*, kma_size_t size);
+KMA_ENTRY void kma_free(void*, kma_size_t size);
+
+/***********************************************************************
+ *  Title: Attaches a persistent heap
+ * ---------------------------------------------------------------------
+ *    Purpose: Keeps the heap in the given file (see attach_pool()).
+ *             If the file holds the heap of an earlier run, it is
+ *             reopened as that run left it: memory allocated then can
+ *             still be read and freed. Must come before the first
+ *             kma_malloc
+ *    Input: the path of the heap file
+ *    Output: TRUE if an existing heap was reopened, FALSE if new
+ ***********************************************************************/
+KMA_ENTRY int kma_attach(char* path);
+
+/***********************************************************************
+ *  Title: Resets the heap
+ * ---------------------------------------------------------------------
+ *    Purpose: Forgets the heap and gives back the pages it keeps track
+ *             of, so that the next kma_malloc starts a new one. Memory
+ *             still allocated from it is lost, and so are pages the
+ *             allocator does not track (spans, pages of their own)
+ *    Input: none
+ *    Output: none
+ ***********************************************************************/
+KMA_ENTRY void kma_reset();
 
 /************External Declaration*****************************************/
 
@@ -0,0 +1,206 @@
+/***************************************************************************
+ *  Title: Asynchronous Allocation
+ * -------------------------------------------------------------------------
+ *    Purpose: A FIFO of requests waiting for the page pool to have room
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#define __KASYNC_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma_async.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// pages an allocator may take for its own bookkeeping on top of the
+// pages of a request (a new page of headers, a bitmap page, ...)
+#define ASYNCSLACK 2
+
+typedef struct kma_waiter
+{
+  kma_size_t size;
+  kma_async_cb_t done;
+  void* arg;
+  struct kma_waiter* next;
+} kma_waiter_t;
+
+/************Global Variables*********************************************/
+
+// parked requests, oldest first
+static kma_waiter_t* wait_head = NULL;
+static kma_waiter_t* wait_tail = NULL;
+
+// set while the queue is served, so that the callbacks' own calls
+// leave it to the outer loop
+static int draining = FALSE;
+
+// set by the page layer whenever pages go back to the pool, from
+// whatever released them. The queue is only looked at again then, and
+// only from kma_malloc_async, kma_free_async and kma_async_run: the
+// release may come from inside an allocator (a shrinker, a reset), so
+// the waiters cannot be served from the hook itself
+static int woken = FALSE;
+
+static kma_async_stat_t async_stats;
+
+/************Function Prototypes******************************************/
+int pagesFor(kma_size_t);
+int tryServe(kma_size_t, kma_async_cb_t, void*);
+void serveWaiting();
+void wakeUp();
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+kma_malloc_async(kma_size_t size, kma_async_cb_t done, void* arg)
+{
+  kma_waiter_t* waiter;
+
+  // nothing will ever make room for it
+  if (pagesFor(size) + ASYNCSLACK > MAXPAGES)
+    {
+      async_stats.num_failed++;
+      done(NULL, arg);
+      return TRUE;
+    }
+
+  serveWaiting();
+  // a request that fits still queues up behind waiting ones
+  if (wait_head == NULL && tryServe(size, done, arg))
+    {
+      async_stats.num_served++;
+      return TRUE;
+    }
+
+  waiter = malloc(sizeof(kma_waiter_t));
+  assert(waiter != NULL);
+  waiter->size = size;
+  waiter->done = done;
+  waiter->arg = arg;
+  waiter->next = NULL;
+
+  page_waker(wakeUp);
+  if (wait_tail != NULL)
+    wait_tail->next = waiter;
+  else
+    wait_head = waiter;
+  wait_tail = waiter;
+
+  async_stats.num_parked++;
+  if (++async_stats.num_waiting > async_stats.max_waiting)
+    {
+      async_stats.max_waiting = async_stats.num_waiting;
+    }
+
+  return FALSE;
+}
+
+void
+kma_free_async(void* ptr, kma_size_t size)
+{
+  kma_free(ptr, size);
+  serveWaiting();
+}
+
+void
+kma_async_run()
+{
+  serveWaiting();
+}
+
+kma_async_stat_t*
+kma_async_stats()
+{
+  return &async_stats;
+}
+
+// the pages a kma_malloc of size may take from the page layer in one go
+int
+pagesFor(kma_size_t size)
+{
+  if (size > PAGESIZE - sizeof(void*))
+    {
+      return SPANPAGES(size);
+    }
+
+  return 1;
+}
+
+// serves the request if the pool has room for it, done gets NULL only
+// if a span still finds no room (the pool changed between the check
+// and the allocation)
+int
+tryServe(kma_size_t size, kma_async_cb_t done, void* arg)
+{
+  int npages = pagesFor(size);
+  void* ptr;
+
+  if (npages == 1)
+    {
+      // the next get_page calls of this thread cannot run out
+      if (!page_reserve(1 + ASYNCSLACK))
+	return FALSE;
+    }
+  else if (page_headroom(npages) < npages + ASYNCSLACK)
+    {
+      return FALSE;
+    }
+
+  ptr = kma_malloc(size);
+  if (ptr == NULL)
+    async_stats.num_failed++;
+  done(ptr, arg);
+  return TRUE;
+}
+
+// serves parked requests from the head of the queue for as long as the
+// next one fits, if pages went back to the pool since the last time
+void
+serveWaiting()
+{
+  kma_waiter_t* waiter;
+
+  if (draining || !woken)
+    {
+      return;
+    }
+
+  draining = TRUE;
+  woken = FALSE;
+  while (wait_head != NULL
+	 && tryServe(wait_head->size, wait_head->done, wait_head->arg))
+    {
+      waiter = wait_head;
+      wait_head = waiter->next;
+      if (wait_head == NULL)
+	wait_tail = NULL;
+      async_stats.num_waiting--;
+      free(waiter);
+    }
+  draining = FALSE;
+}
+
+// page layer hook, see woken
+void
+wakeUp()
+{
+  woken = TRUE;
+}
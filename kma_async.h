@@ -0,0 +1,110 @@
+/***************************************************************************
+ *  Title: Asynchronous Allocation
+ * -------------------------------------------------------------------------
+ *    Purpose: Interface for allocations that wait for free pages instead
+ *             of failing when the page pool is exhausted
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#ifndef __KASYNC_H__
+#define __KASYNC_H__
+
+/************System include***********************************************/
+
+/************Private include**********************************************/
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#undef EXTERN
+#ifdef __KASYNC_IMPL__
+#define EXTERN
+#else
+#define EXTERN extern
+#endif
+
+/* called with the memory once a request is served, NULL if it can
+   never be (larger than the whole pool) or if the allocator failed
+   it anyway */
+typedef void (*kma_async_cb_t)(void* ptr, void* arg);
+
+typedef struct
+{
+  int num_served;    /* requests served right away */
+  int num_parked;    /* requests that had to wait */
+  int num_waiting;   /* requests waiting now */
+  int max_waiting;
+  int num_failed;    /* requests done was called with NULL for */
+} kma_async_stat_t;
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Allocates memory, waiting for free pages if need be
+ * ---------------------------------------------------------------------
+ *    Purpose: Serves the request with kma_malloc and calls done right
+ *             away if the pool has room for the pages it may take (a
+ *             single page is reserved beforehand, so kma_malloc cannot
+ *             run out). Otherwise, or if earlier requests are still
+ *             waiting, the request is parked. Whenever pages go back to
+ *             the pool, through any free_page, free_pages or
+ *             free_page_span, the queue is served again at the next
+ *             kma_malloc_async, kma_free_async or kma_async_run, in the
+ *             order the requests came in. Like the allocators, not
+ *             thread safe
+ *    Input: the size, the callback and its argument
+ *    Output: TRUE if done was called before returning
+ ***********************************************************************/
+EXTERN int kma_malloc_async(kma_size_t size, kma_async_cb_t done, void* arg);
+
+/***********************************************************************
+ *  Title: Frees memory and resumes waiting requests
+ * ---------------------------------------------------------------------
+ *    Purpose: Frees with kma_free, then serves parked requests from
+ *             the head of the queue for as long as the pool has room
+ *             for the next one, if pages went back to the pool. A
+ *             callback may allocate and free again
+ *    Input: the memory and its size
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_free_async(void* ptr, kma_size_t size);
+
+/***********************************************************************
+ *  Title: Resumes waiting requests
+ * ---------------------------------------------------------------------
+ *    Purpose: Serves parked requests if pages went back to the pool
+ *             since the queue was last looked at, e.g. through plain
+ *             kma_free or a shrinker. For callers that release memory
+ *             other than with kma_free_async. Not from inside an
+ *             allocator
+ *    Input: none
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_async_run();
+
+/***********************************************************************
+ *  Title: Asynchronous allocation statistics
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the counters of the wait queue
+ *    Input: none
+ *    Output: the counters in a static buffer
+ ***********************************************************************/
+EXTERN kma_async_stat_t* kma_async_stats();
+
+/************External Declaration*****************************************/
+
+/**************Definition***************************************************/
+
+#endif /* __KASYNC_H__ */
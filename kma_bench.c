@@ -0,0 +1,713 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Micro benchmarks for the page layer and the allocators
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#define __KMA_BENCH_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma_async.h"
+#include "kma_trace.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+typedef struct
+{
+  int ops;
+  int live;
+} churn_arg_t;
+
+typedef struct
+{
+  int ops;
+  int live;
+  int node;
+  int remote;  // pages that came from another node
+} node_arg_t;
+
+// one request stream of bench_streams. It runs until it has to wait for
+// an allocation and picks up at the same op once it is served
+typedef struct
+{
+  int* ops;         // indices into the trace
+  int num_ops;
+  int next;         // the op to run
+  int waiting;
+  double since;     // when it started waiting, 0 if it did not
+  double wait_us;
+} stream_t;
+
+/************Global Variables*********************************************/
+
+static char* name = NULL;
+
+// the trace and the blocks of bench_streams
+static kma_trace_t trace;
+static void** blocks = NULL;
+
+/************Function Prototypes******************************************/
+void usage();
+void error(char*, char*);
+double now_us();
+long resident_kb();
+void bench_coldstart(int, char**);
+void bench_churn(int, char**);
+void bench_threads(int, char**);
+void bench_fragment(int, char**);
+void bench_numa(int, char**);
+void bench_streams(int, char**);
+void* churn_pages(void*);
+void* churn_node(void*);
+void resume_stream(void*, void*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  name = argv[0];
+
+  if (argc < 2)
+    {
+      usage();
+    }
+
+  if (strcmp(argv[1], "coldstart") == 0)
+    {
+      bench_coldstart(argc - 2, argv + 2);
+    }
+  else if (strcmp(argv[1], "churn") == 0)
+    {
+      bench_churn(argc - 2, argv + 2);
+    }
+  else if (strcmp(argv[1], "threads") == 0)
+    {
+      bench_threads(argc - 2, argv + 2);
+    }
+  else if (strcmp(argv[1], "fragment") == 0)
+    {
+      bench_fragment(argc - 2, argv + 2);
+    }
+  else if (strcmp(argv[1], "numa") == 0)
+    {
+      bench_numa(argc - 2, argv + 2);
+    }
+  else if (strcmp(argv[1], "streams") == 0)
+    {
+      bench_streams(argc - 2, argv + 2);
+    }
+  else
+    {
+      usage();
+    }
+
+  return 0;
+}
+
+void
+usage()
+{
+  printf("Usage: %s coldstart [size]\n"
+	 "       %s churn [ops] [live] [size]\n"
+	 "       %s threads [max threads] [ops per thread] [live]\n"
+	 "       %s fragment [ops] [live] [max span] [lru|address]\n"
+	 "       %s numa [nodes] [threads] [ops per thread] [live] "
+	 "[node chunks]\n"
+	 "       %s streams trace [streams]\n",
+	 name, name, name, name, name, name);
+  exit(0);
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
+
+// monotonic wall clock in microseconds
+double
+now_us()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// resident set of this process in KB, from /proc/self/statm
+long
+resident_kb()
+{
+  long size, resident;
+  FILE* f = fopen("/proc/self/statm", "r");
+
+  if (f == NULL)
+    {
+      return -1;
+    }
+  if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+    {
+      resident = -1;
+    }
+  fclose(f);
+
+  return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/***********************************************************************
+ *  Title: Cold start benchmark
+ * ---------------------------------------------------------------------
+ *    Purpose: Measures how long the very first kma_malloc of the
+ *             process takes (this includes setting up the page pool)
+ *             and how much the resident set grows because of it
+ *    Input: optional request size (default 32 bytes)
+ *    Output: none
+ ***********************************************************************/
+void
+bench_coldstart(int argc, char* argv[])
+{
+  int size = (argc > 0) ? atoi(argv[0]) : 32;
+  long rss_before, rss_after;
+  double start, end;
+  void* ptr;
+
+  rss_before = resident_kb();
+
+  start = now_us();
+  ptr = kma_malloc(size);
+  end = now_us();
+
+  rss_after = resident_kb();
+
+  if (ptr == NULL)
+    {
+      error("first allocation failed", "");
+    }
+  kma_free(ptr, size);
+
+  printf("%s: coldstart size %d: first allocation %.1f us, "
+         "RSS %ld KB -> %ld KB (+%ld KB)\n",
+	 name, size, end - start, rss_before, rss_after,
+	 rss_after - rss_before);
+}
+
+/***********************************************************************
+ *  Title: Churn benchmark
+ * ---------------------------------------------------------------------
+ *    Purpose: Keeps a ring of live allocations and replaces the oldest
+ *             one on every step. With KMA_DUMMY every step is one
+ *             get_page and one free_page, so this measures the cost of
+ *             the page layer itself
+ *    Input: optional number of steps (default 1000000), number of live
+ *           allocations (default 64) and request size (default 64)
+ *    Output: none
+ ***********************************************************************/
+void
+bench_churn(int argc, char* argv[])
+{
+  int ops = (argc > 0) ? atoi(argv[0]) : 1000000;
+  int live = (argc > 1) ? atoi(argv[1]) : 64;
+  int size = (argc > 2) ? atoi(argv[2]) : 64;
+  void** ring;
+  double start, end;
+  kma_page_stat_t* stat;
+  int i;
+
+  if (ops <= 0 || live <= 0)
+    {
+      usage();
+    }
+
+  ring = malloc(live * sizeof(void*));
+  assert(ring != NULL);
+
+  for (i = 0; i < live; i++)
+    {
+      ring[i] = kma_malloc(size);
+    }
+
+  start = now_us();
+  for (i = 0; i < ops; i++)
+    {
+      kma_free(ring[i % live], size);
+      ring[i % live] = kma_malloc(size);
+    }
+  end = now_us();
+
+  for (i = 0; i < live; i++)
+    {
+      kma_free(ring[i], size);
+    }
+  free(ring);
+
+  stat = page_stats();
+  printf("%s: churn %d ops, %d live, size %d: %.1f ns/op, "
+         "pages requested %d\n",
+	 name, ops, live, size, (end - start) * 1e3 / ops,
+	 stat->num_requested);
+}
+
+/***********************************************************************
+ *  Title: Multi-threaded page churn benchmark
+ * ---------------------------------------------------------------------
+ *    Purpose: Runs 1, 2, 4, ... up to max threads that each churn
+ *             pages through get_page/free_page directly (the
+ *             allocators themselves are single threaded) and reports
+ *             the aggregate page operations per second
+ *    Input: optional maximum number of threads (default 8), steps per
+ *           thread (default 1000000) and live pages per thread
+ *           (default 64)
+ *    Output: none
+ ***********************************************************************/
+void
+bench_threads(int argc, char* argv[])
+{
+  int max_threads = (argc > 0) ? atoi(argv[0]) : 8;
+  churn_arg_t arg;
+  kma_page_stat_t* stat;
+  pthread_t* threads;
+  double start, end;
+  int n, i;
+
+  arg.ops = (argc > 1) ? atoi(argv[1]) : 1000000;
+  arg.live = (argc > 2) ? atoi(argv[2]) : 64;
+
+  if (max_threads <= 0 || arg.ops <= 0 || arg.live <= 0)
+    {
+      usage();
+    }
+
+  threads = malloc(max_threads * sizeof(pthread_t));
+  assert(threads != NULL);
+
+  for (n = 1; n <= max_threads; n *= 2)
+    {
+      start = now_us();
+      for (i = 0; i < n; i++)
+	{
+	  if (pthread_create(&threads[i], NULL, churn_pages, &arg) != 0)
+	    {
+	      error("unable to start benchmark thread", "");
+	    }
+	}
+      for (i = 0; i < n; i++)
+	{
+	  pthread_join(threads[i], NULL);
+	}
+      end = now_us();
+
+      printf("%s: threads %2d: %d ops each, %d live: %.2f Mops/s, "
+	     "%.1f ns/op per thread\n",
+	     name, n, arg.ops, arg.live, (double) n * arg.ops / (end - start),
+	     (end - start) * 1e3 / arg.ops);
+    }
+
+  free(threads);
+
+  stat = page_stats();
+  printf("%s: Page Requested/Freed/In Use: %d/%d/%d\n", name,
+	 stat->num_requested, stat->num_freed, stat->num_in_use);
+}
+
+/***********************************************************************
+ *  Title: Fragmenting page churn benchmark
+ * ---------------------------------------------------------------------
+ *    Purpose: Keeps live page allocations and replaces a random one on
+ *             every step, one in eight of them by a span of 2 to max
+ *             span pages. Frees in random order scatter the free pages
+ *             over the chunks, so this exercises the free page index
+ *             of the page layer rather than the per thread caches.
+ *             Reports the average cost of get_page and get_page_span
+ *             and the most chunks mapped
+ *    Input: optional number of steps (default 1000000), live
+ *           allocations (default 4096), longest span (default 16)
+ *           and the placement policy (default lru)
+ *    Output: none
+ ***********************************************************************/
+void
+bench_fragment(int argc, char* argv[])
+{
+  int ops = (argc > 0) ? atoi(argv[0]) : 1000000;
+  int live = (argc > 1) ? atoi(argv[1]) : 4096;
+  int max_span = (argc > 2) ? atoi(argv[2]) : 16;
+  kma_page_t** ring;
+  unsigned int seed = 1;
+  int npages, nspans = 0;
+  double page_us = 0, span_us = 0;
+  double start;
+  char page_ns[32] = "n/a", span_ns[32] = "n/a";
+  int i, victim;
+
+  if (ops <= 0 || live <= 0 || max_span < 2)
+    {
+      usage();
+    }
+  if (argc > 3)
+    {
+      page_config()->address_order = (strcmp(argv[3], "address") == 0);
+    }
+
+  ring = malloc(live * sizeof(kma_page_t*));
+  assert(ring != NULL);
+
+  get_pages(live, ring);
+
+  for (i = 0; i < ops; i++)
+    {
+      victim = rand_r(&seed) % live;
+      if (ring[victim]->size > PAGESIZE)
+	free_page_span(ring[victim]);
+      else
+	free_page(ring[victim]);
+
+      // time the allocations only, the frees are the same either way
+      if (rand_r(&seed) % 8 == 0)
+	{
+	  npages = 2 + rand_r(&seed) % (max_span - 1);
+	  start = now_us();
+	  ring[victim] = get_page_span(npages);
+	  span_us += now_us() - start;
+	  nspans++;
+	}
+      else
+	{
+	  start = now_us();
+	  ring[victim] = get_page();
+	  page_us += now_us() - start;
+	}
+      *((kma_page_t**) ring[victim]->ptr) = ring[victim];
+    }
+
+  for (i = 0; i < live; i++)
+    {
+      if (ring[i]->size > PAGESIZE)
+	free_page_span(ring[i]);
+      else
+	free_page(ring[i]);
+    }
+  free(ring);
+
+  // the draw may have picked only one kind in a short run
+  if (ops > nspans)
+    {
+      snprintf(page_ns, sizeof(page_ns), "%.1f ns",
+	       page_us * 1e3 / (ops - nspans));
+    }
+  if (nspans > 0)
+    {
+      snprintf(span_ns, sizeof(span_ns), "%.1f ns", span_us * 1e3 / nspans);
+    }
+  printf("%s: fragment %d ops, %d live, spans up to %d pages, %s: "
+	 "get_page %s, get_page_span %s, peak chunks %d\n",
+	 name, ops, live, max_span,
+	 page_config()->address_order ? "address order" : "lru order",
+	 page_ns, span_ns, page_stats()->num_peak_chunks);
+}
+
+/***********************************************************************
+ *  Title: Node local page churn benchmark
+ * ---------------------------------------------------------------------
+ *    Purpose: Splits the pool into fake memory nodes and runs threads
+ *             that each churn pages of one node (thread i asks for
+ *             node i % nodes) through get_page_node. With few chunks
+ *             per node the nodes fill up and spill, so this shows the
+ *             cost of the per node free lists and the spill rate
+ *    Input: optional number of nodes (default 2), threads (default 4),
+ *           steps per thread (default 1000000), live pages per thread
+ *           (default 1024) and chunks per node (default 0, an equal
+ *           share of the pool)
+ *    Output: none
+ ***********************************************************************/
+void
+bench_numa(int argc, char* argv[])
+{
+  int nodes = (argc > 0) ? atoi(argv[0]) : 2;
+  int n = (argc > 1) ? atoi(argv[1]) : 4;
+  node_arg_t* args;
+  pthread_t* threads;
+  kma_page_stat_t stat;
+  double start, end;
+  long remote = 0;
+  int i;
+  
+  if (nodes <= 0 || nodes > PAGE_MAXNODES || n <= 0)
+    {
+      usage();
+    }
+  page_config()->nodes = nodes;
+  page_config()->node_chunks = (argc > 4) ? atoi(argv[4]) : 0;
+  
+  args = malloc(n * sizeof(node_arg_t));
+  threads = malloc(n * sizeof(pthread_t));
+  assert(args != NULL && threads != NULL);
+  
+  start = now_us();
+  for (i = 0; i < n; i++)
+    {
+      args[i].ops = (argc > 2) ? atoi(argv[2]) : 1000000;
+      args[i].live = (argc > 3) ? atoi(argv[3]) : 1024;
+      args[i].node = i % nodes;
+      args[i].remote = 0;
+      if (pthread_create(&threads[i], NULL, churn_node, &args[i]) != 0)
+	{
+	  error("unable to start benchmark thread", "");
+	}
+    }
+  for (i = 0; i < n; i++)
+    {
+      pthread_join(threads[i], NULL);
+      remote += args[i].remote;
+    }
+  end = now_us();
+  
+  page_snapshot(&stat);
+  printf("%s: numa %d nodes, %d threads, %d ops each, %d live: %.2f Mops/s, "
+	 "remote pages %.2f%%\n", name, nodes, n, args[0].ops, args[0].live,
+	 (double) n * args[0].ops / (end - start),
+	 100.0 * remote / ((double) n * (args[0].ops + args[0].live)));
+  for (i = 0; i < stat.num_nodes; i++)
+    {
+      printf("%s: node %d: %d chunks at the end, %d pages spilled\n", name,
+	     i, stat.node_chunks[i], stat.node_spills[i]);
+    }
+  
+  free(args);
+  free(threads);
+}
+
+/***********************************************************************
+ *  Title: Interleaved trace streams benchmark
+ * ---------------------------------------------------------------------
+ *    Purpose: Splits a trace into streams by request id and replays
+ *             them round robin through kma_malloc_async and
+ *             kma_free_async, one op per turn. A stream whose
+ *             allocation has to wait for the pool stops until a free
+ *             of another stream serves it, so with a small pool
+ *             (-DMAXPAGES) the replay goes on where kma_malloc would
+ *             have failed. A request that fails anyway is skipped.
+ *             Reports how often and how long streams waited, how many
+ *             requests failed, or the deadlock if every stream ends up
+ *             waiting
+ *    Input: the trace file (text or binary), optional number of
+ *           streams (default 8)
+ *    Output: none
+ ***********************************************************************/
+void
+bench_streams(int argc, char* argv[])
+{
+  int n = (argc > 1) ? atoi(argv[1]) : 8;
+  stream_t* streams;
+  stream_t* s;
+  kma_async_stat_t* stat;
+  kma_trace_rec_t* op;
+  int* sizes;
+  int done, running, waiting;
+  double start, end, wait_us = 0;
+  int i;
+
+  if (argc < 1 || n <= 0)
+    {
+      usage();
+    }
+  trace_load(&trace, argv[0]);
+
+  blocks = calloc(trace.n_req, sizeof(void*));
+  sizes = calloc(trace.n_req, sizeof(int));
+  assert(blocks != NULL && sizes != NULL);
+  for (i = 0; i < trace.n_ops; i++)
+    {
+      op = &trace.recs[i];
+      if (!TRACE_ISFREE(op))
+	sizes[TRACE_ID(op)] = op->size;
+    }
+
+  streams = calloc(n, sizeof(stream_t));
+  assert(streams != NULL);
+  // all ops on one id land in the same stream, so a free always comes
+  // after its request
+  for (i = 0; i < trace.n_ops; i++)
+    {
+      streams[TRACE_ID(&trace.recs[i]) % n].num_ops++;
+    }
+  for (i = 0; i < n; i++)
+    {
+      streams[i].ops = malloc((streams[i].num_ops + 1) * sizeof(int));
+      assert(streams[i].ops != NULL);
+      streams[i].num_ops = 0;
+    }
+  for (i = 0; i < trace.n_ops; i++)
+    {
+      s = &streams[TRACE_ID(&trace.recs[i]) % n];
+      s->ops[s->num_ops++] = i;
+    }
+
+  start = now_us();
+  do
+    {
+      // pages a shrinker gave back are only picked up at the next call
+      kma_async_run();
+      running = waiting = 0;
+      for (i = 0; i < n; i++)
+	{
+	  s = &streams[i];
+	  if (s->waiting)
+	    {
+	      waiting++;
+	      continue;
+	    }
+	  if (s->next == s->num_ops)
+	    continue;
+
+	  running++;
+	  op = &trace.recs[s->ops[s->next]];
+	  if (!TRACE_ISFREE(op))
+	    {
+	      // resume_stream runs before this returns if the pool has room
+	      s->waiting = TRUE;
+	      s->since = 0;
+	      if (!kma_malloc_async(op->size, resume_stream, s))
+		s->since = now_us();
+	    }
+	  else
+	    {
+	      s->next++;
+	      if (blocks[TRACE_ID(op)] != NULL)
+		kma_free_async(blocks[TRACE_ID(op)], sizes[TRACE_ID(op)]);
+	      blocks[TRACE_ID(op)] = NULL;
+	    }
+	}
+    }
+  while (running > 0);
+  end = now_us();
+
+  stat = kma_async_stats();
+  for (i = 0, done = 0; i < n; i++)
+    {
+      done += streams[i].next;
+      wait_us += streams[i].wait_us;
+    }
+
+  printf("%s: streams %s, %d streams, %ld ops: %.2f ms, %d served at once, "
+	 "%d waited (%.1f us on average, at most %d at once), %d failed\n",
+	 name, argv[0], n, trace.n_ops, (end - start) / 1e3, stat->num_served,
+	 stat->num_parked,
+	 stat->num_parked > 0 ? wait_us / stat->num_parked : 0.0,
+	 stat->max_waiting, stat->num_failed);
+  if (waiting > 0)
+    {
+      // nothing left to run that could free pages for the waiting ones
+      printf("%s: deadlock after %d of %ld ops, %d streams waiting\n",
+	     name, done, trace.n_ops, waiting);
+    }
+
+  for (i = 0; i < trace.n_req; i++)
+    {
+      if (blocks[i] != NULL)
+	kma_free(blocks[i], sizes[i]);
+    }
+  for (i = 0; i < n; i++)
+    {
+      free(streams[i].ops);
+    }
+  free(streams);
+  free(sizes);
+  free(blocks);
+  trace_unload(&trace);
+}
+
+// kma_malloc_async callback of bench_streams, wakes up the stream
+void
+resume_stream(void* ptr, void* arg)
+{
+  stream_t* s = (stream_t*) arg;
+  kma_trace_rec_t* op = &trace.recs[s->ops[s->next]];
+
+  // a failed request is skipped, its free finds a NULL block
+  if (ptr != NULL)
+    {
+      // touch the block like the harness does
+      *((int*) ptr) = TRACE_ID(op);
+    }
+  blocks[TRACE_ID(op)] = ptr;
+  if (s->since > 0)
+    s->wait_us += now_us() - s->since;
+  s->waiting = FALSE;
+  s->next++;
+}
+
+// thread body for bench_numa
+void*
+churn_node(void* data)
+{
+  node_arg_t* arg = (node_arg_t*) data;
+  kma_page_t** ring = malloc(arg->live * sizeof(kma_page_t*));
+  unsigned int seed = arg->node + 1;
+  int i, victim;
+  
+  assert(ring != NULL);
+  
+  for (i = 0; i < arg->live + arg->ops; i++)
+    {
+      victim = (i < arg->live) ? i : rand_r(&seed) % arg->live;
+      if (i >= arg->live)
+	free_page(ring[victim]);
+      ring[victim] = get_page_node(arg->node);
+      *((kma_page_t**) ring[victim]->ptr) = ring[victim];
+      if (page_node(ring[victim]) != arg->node)
+	arg->remote++;
+    }
+  free_pages(ring, arg->live);
+  
+  free(ring);
+  return NULL;
+}
+
+// thread body for bench_threads
+void*
+churn_pages(void* data)
+{
+  churn_arg_t* arg = (churn_arg_t*) data;
+  kma_page_t** ring = malloc(arg->live * sizeof(kma_page_t*));
+  int i;
+
+  assert(ring != NULL);
+
+  get_pages(arg->live, ring);
+  for (i = 0; i < arg->ops; i++)
+    {
+      free_page(ring[i % arg->live]);
+      ring[i % arg->live] = get_page();
+      // touch the page like an allocator writing its header would
+      *((kma_page_t**) ring[i % arg->live]->ptr) = ring[i % arg->live];
+    }
+  free_pages(ring, arg->live);
+
+  free(ring);
+  return NULL;
+}
@@ -45,6 +45,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h> 
+#include <strings.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -54,9 +55,20 @@
 
 /************Global Variables*********************************************/
 #define MIN_BUFFER_SIZE 32
-			// index 	0  | 1  |  2  |  3  |  4  |  5   |  6   |   7
-#define BUFFER_NUM 8 // 32 | 64 | 128 | 256 | 512 | 1024 | 2048 | 4096
-#define BITMAP_NUM PAGESIZE / MIN_BUFFER_SIZE / sizeof(int) / 8
+			// index 	0  | 1  |  2  |  3  |  4  |  5   |  6   |   7  | ...
+			//      	32 | 64 | 128 | 256 | 512 | 1024 | 2048 | 4096 | ... PAGESIZE/2
+#define BUFFER_NUM (ffs(PAGESIZE / MIN_BUFFER_SIZE) - 1)
+#define MAX_BUFFER_NUM 11 // for MAXPAGESIZE
+#define BITMAP_NUM (PAGESIZE / MIN_BUFFER_SIZE / (sizeof(int) * 8))
+// page_node_t plus its bitmap
+#define PAGE_NODE_SIZE (sizeof(page_node_t) + BITMAP_NUM * sizeof(unsigned int))
+// buffers and the smallest buddy block taken by the page_node_t
+#define PAGE_NODE_UNITS ((PAGE_NODE_SIZE - 1) / MIN_BUFFER_SIZE + 1)
+#define PAGE_NODE_SPAN (2 << (31 - __builtin_clz(PAGE_NODE_SIZE)))
+// a split page keeps its page_node_t in the buddy block of its color,
+// a whole page (mode 1) at the start
+#define PAGE_NODE(page) \
+	((page_node_t*)((void*)(page) + HDROFFSET(page, PAGE_NODE_SPAN)))
 static kma_page_t* page_head = NULL;
 
 /************Defines and Typedefs*****************************************/
@@ -71,33 +83,34 @@ typedef struct block_node_struct{
 
 typedef struct page_node_struct {
 	kma_page_t* ptr_back; // pointing back to the kma struct for free page
-	unsigned int bitmap[BITMAP_NUM];
+	unsigned int bitmap[]; // BITMAP_NUM words, one bit per MIN_BUFFER_SIZE
 } page_node_t;
 
 typedef struct {
 	void* ptr_back;
-	block_node_t* block_entry[BUFFER_NUM];
+	block_node_t* block_entry[MAX_BUFFER_NUM];
 	int page_count;
 } entry_page_node_t;
 
 
 /************Function Prototypes******************************************/
-kma_size_t find_round_size(kma_size_t);
-void set_bit(unsigned int [], unsigned int);
-void clear_bit(unsigned int [], unsigned int);
-int get_bit(unsigned int [], unsigned int);
-int find_block_index(kma_size_t);
-void add_block(void*, int);
-void init_free_block(kma_page_t*);
-void* init_page_node(int);
-void init_entry_page_node();
-void* find_free_block(block_node_t* block_entry[], int);
-bool page_ready_to_free(void*);
-block_node_t* find_buddy(void* page, void* ptr, kma_size_t round_size);
-void remove_buddy_block(block_node_t* buddy, int index);
-void remove_page_blocks(block_node_t* buddy, int index);
-void free_page_node(void*);
-void coalesce(void* page, void* ptr, kma_size_t round_size);
+static kma_size_t find_round_size(kma_size_t);
+static void set_bit(unsigned int [], unsigned int);
+static void clear_bit(unsigned int [], unsigned int);
+static int get_bit(unsigned int [], unsigned int);
+static int find_block_index(kma_size_t);
+static void add_block(void*, int);
+static void init_free_block(kma_page_t*);
+static void* init_page_node(int);
+static void* setup_page_node(kma_page_t*, int);
+static void init_entry_page_node(kma_page_t*);
+static void* find_free_block(block_node_t* block_entry[], int);
+static bool page_ready_to_free(void*);
+static block_node_t* find_buddy(void* page, void* ptr, kma_size_t round_size);
+static void remove_buddy_block(block_node_t* buddy, int index);
+static void remove_page_blocks(block_node_t* buddy, int index);
+static void free_page_node(void*);
+static void coalesce(void* page, void* ptr, kma_size_t round_size);
 /************External Declaration*****************************************/
 
 /***********Debug Function*************************************************/
@@ -125,7 +138,7 @@ void print_free_block() {
 
 /**************Implementation***********************************************/
 
-kma_size_t find_round_size(kma_size_t size) {
+static kma_size_t find_round_size(kma_size_t size) {
 	if(size == 0) return 0;
 	kma_size_t round_size = 1;
 	while(round_size < size){
@@ -134,7 +147,7 @@ kma_size_t find_round_size(kma_size_t size) {
 	return round_size < MIN_BUFFER_SIZE ? MIN_BUFFER_SIZE : round_size;
 }
 
-void set_bit(unsigned int A[], unsigned int i) {
+static void set_bit(unsigned int A[], unsigned int i) {
 	int index = i / (sizeof(unsigned int) * 8);
 	int pos = i % (sizeof(unsigned int) * 8);
 	unsigned int mask = 1;
@@ -142,7 +155,7 @@ void set_bit(unsigned int A[], unsigned int i) {
 	A[index] |= mask;
 }
 
-void clear_bit(unsigned int A[], unsigned int i) {
+static void clear_bit(unsigned int A[], unsigned int i) {
 	int index = i / (sizeof(unsigned int) * 8);
 	int pos = i % (sizeof(unsigned int) * 8);
 	unsigned int mask = 1;
@@ -151,7 +164,7 @@ void clear_bit(unsigned int A[], unsigned int i) {
 	A[index] &= mask;
 }
 
-int get_bit(unsigned int A[], unsigned int i) {
+static int get_bit(unsigned int A[], unsigned int i) {
 	int index = i / (sizeof(unsigned int) * 8);
 	int pos = i % (sizeof(unsigned int) * 8);
 	unsigned int mask = 1;
@@ -159,7 +172,7 @@ int get_bit(unsigned int A[], unsigned int i) {
 	return ((A[index] & mask) == 0) ? 0 : 1;
 }
 
-int find_block_index(kma_size_t size) {
+static int find_block_index(kma_size_t size) {
 	int index = 0;
 	while(size != 0){
 		index++;
@@ -169,22 +182,22 @@ int find_block_index(kma_size_t size) {
 }
 
 /* This function add node at the beginning of the list */
-void add_block(void* addr, int index) {
+static void add_block(void* addr, int index) {
 	((block_node_t*)addr)->next = ((entry_page_node_t*)page_head->ptr)->block_entry[index];
 	((entry_page_node_t*)page_head->ptr)->block_entry[index] = (block_node_t*)addr;
 }
 
 /* 
- *  Split the new page into 64, 128, 256, 512, 1024, 2048, 4096 blocks
- *  The rest 64B stores the page_node_t structure
+ *  Split the new page into 64, 128, 256, ..., PAGESIZE/2 blocks
+ *  The rest stores the page_node_t structure and its bitmap
  */
-void init_free_block(kma_page_t* page) {
-	int size = (int)sizeof(page_node_t);
-	kma_size_t cur_size = PAGESIZE;
-	while(cur_size / 2 > size) {
-		cur_size /= 2;
+static void init_free_block(kma_page_t* page) {
+	unsigned long node = (void*)PAGE_NODE(page->ptr) - page->ptr;
+	kma_size_t cur_size;
+	/* the buddy of every block that contains the page node */
+	for(cur_size = PAGE_NODE_SPAN; cur_size < PAGESIZE; cur_size *= 2) {
 		int index = find_block_index(cur_size);
-		add_block(page->ptr + cur_size, index);
+		add_block(page->ptr + ((node & ~(cur_size - 1)) ^ cur_size), index);
 	}
 }
 
@@ -193,14 +206,19 @@ void init_free_block(kma_page_t* page) {
  * O.W. mode = 0
  */ 
 
-void* init_page_node(int mode) { 
-	kma_page_t* page = get_page();
-	page_node_t* page_node = (page_node_t*)(page->ptr);
+static void* init_page_node(int mode) { 
+	return setup_page_node(get_page(), mode);
+}
+
+/* Same as init_page_node, for a page the caller already got */
+static void* setup_page_node(kma_page_t* page, int mode) {
+	page_node_t* page_node = (mode == 0) ? PAGE_NODE(page->ptr) : (page_node_t*)(page->ptr);
 	page_node->ptr_back = page;
-	/* Init bitmap for new page */
+	/* Init bitmap for new page, a whole page (mode 1) keeps only ptr_back */
+	int first = ((void*)page_node - page->ptr) / MIN_BUFFER_SIZE;
 	int i;
-	for(i = 0; i < PAGESIZE / MIN_BUFFER_SIZE; i++)
-		if(((sizeof(page_node_t) - 1) / MIN_BUFFER_SIZE + 1) > i || mode == 1)
+	for(i = 0; mode == 0 && i < PAGESIZE / MIN_BUFFER_SIZE; i++)
+		if(i >= first && i < first + PAGE_NODE_UNITS)
 			set_bit(page_node->bitmap, i);
 		else
 			clear_bit(page_node->bitmap, i);
@@ -217,9 +235,7 @@ void* init_page_node(int mode) {
  * This function initialize the entry page 
  * Entry page stores array of different block size headers
  */
-void init_entry_page_node() {
-	kma_page_t* page;
-	page = get_page();
+static void init_entry_page_node(kma_page_t* page) {
 	entry_page_node_t* entry_page_node = (entry_page_node_t*)(page->ptr);
 	entry_page_node->ptr_back = page;
 	entry_page_node->page_count = 1;
@@ -234,7 +250,7 @@ void init_entry_page_node() {
  * This function find the required block from free list
  * If no available block exists, allocate new page
  */
-void* find_free_block(block_node_t* block_entry[], int round_size){
+static void* find_free_block(block_node_t* block_entry[], int round_size){
 	/* Find first fit free block */
 	int i, c;
 	unsigned int k;
@@ -256,7 +272,7 @@ void* find_free_block(block_node_t* block_entry[], int round_size){
 			void* start_of_page = BASEADDR(addr);
 			k = ((void*)addr - start_of_page) / MIN_BUFFER_SIZE;
 			for(c = cur_size / MIN_BUFFER_SIZE; c >= 1; c--, k++) {
-				set_bit(((page_node_t*)start_of_page)->bitmap, k);
+				set_bit(PAGE_NODE(start_of_page)->bitmap, k);
 			}
 			return (void*)addr;
 		}
@@ -269,21 +285,24 @@ void* find_free_block(block_node_t* block_entry[], int round_size){
 
 void* kma_malloc(kma_size_t size) {
 	/* if over size */
-	if((size + (int)sizeof(page_node_t)) > PAGESIZE) return NULL;
+	if((size + (int)sizeof(page_node_t)) > PAGESIZE) return get_span_block(size);
 
 	/* if first page does not exist */  
 	kma_size_t round_size = find_round_size(size);
 	if(page_head == NULL) {
-		init_entry_page_node();
-		/* If required size is over 4096, give the whole page */
-		if(size > 4096){
-			void* addr = init_page_node(1);
+		/* Entry page and first page node come from one batch */
+		kma_page_t* pages[2];
+		get_pages(2, pages);
+		init_entry_page_node(pages[0]);
+		/* If required size is over half a page, give the whole page */
+		if(size > PAGESIZE / 2){
+			void* addr = setup_page_node(pages[1], 1);
 			return addr + sizeof(page_node_t);
 		} else {
-			init_page_node(0);
+			setup_page_node(pages[1], 0);
 		}
 	}
-	if(size > 4096){
+	if(size > PAGESIZE / 2){
 		void* addr = init_page_node(1);
 		return addr + sizeof(page_node_t);
 	}
@@ -294,22 +313,32 @@ void* kma_malloc(kma_size_t size) {
 }
 
 /* Check the bitmap to see whether the page can be freed */
-bool page_ready_to_free(void* start_of_page) {
-	int i;
-	unsigned long long sum = 0;
-	for(i = 0; i < BUFFER_NUM; i++){
-		sum += ((page_node_t*)start_of_page)->bitmap[i];
+/* Only the bits of the page_node_t itself may still be set */
+static bool page_ready_to_free(void* start_of_page) {
+	page_node_t* page_node = PAGE_NODE(start_of_page);
+	int first = ((void*)page_node - start_of_page) / MIN_BUFFER_SIZE;
+	int i, lo, hi;
+	unsigned int header;
+	for(i = 0; i < BITMAP_NUM; i++){
+		/* the bits of the page node that fall into this word */
+		lo = first - i * 32;
+		hi = lo + PAGE_NODE_UNITS;
+		if(lo < 0) lo = 0;
+		if(hi > 32) hi = 32;
+		header = (lo >= hi) ? 0 : (~0U >> (32 - hi)) & (~0U << lo);
+		if(page_node->bitmap[i] != header)
+			return FALSE;
 	}
-	return sum == 3 ? TRUE : FALSE;
+	return TRUE;
 }
 
 /* Find buddy, if not exists, return NULL */
-block_node_t* find_buddy(void* page, void* ptr, kma_size_t round_size) {
+static block_node_t* find_buddy(void* page, void* ptr, kma_size_t round_size) {
 	block_node_t* buddy = (block_node_t*)((unsigned long int)ptr ^ (unsigned long int)round_size);
 	int k = ((void*)buddy - page) / MIN_BUFFER_SIZE;
 	int i = round_size / MIN_BUFFER_SIZE;
 	for(; i > 0; i--, k++) {
-		if(get_bit(((page_node_t*)page)->bitmap, k) == 1)
+		if(get_bit(PAGE_NODE(page)->bitmap, k) == 1)
 			return NULL;
 	}
 	return buddy;
@@ -318,7 +347,7 @@ block_node_t* find_buddy(void* page, void* ptr, kma_size_t round_size) {
 /*
  *  Remove target block from the free list
  */
-void remove_buddy_block(block_node_t* target, int index){
+static void remove_buddy_block(block_node_t* target, int index){
 	block_node_t* head = ((entry_page_node_t*)page_head->ptr)->block_entry[index];;
 	if(head == NULL) return;
 	/* Check first node */
@@ -341,7 +370,7 @@ void remove_buddy_block(block_node_t* target, int index){
 }
 
 /* Remove all the blocks in a page from the free list */
-void remove_page_blocks(block_node_t* start_of_page, int index){
+static void remove_page_blocks(block_node_t* start_of_page, int index){
 	block_node_t* head = ((entry_page_node_t*)page_head->ptr)->block_entry[index];;
 	if(head == NULL) return;
 	/* Find first node which does not need to be deleted as the new head */
@@ -366,14 +395,14 @@ void remove_page_blocks(block_node_t* start_of_page, int index){
 	}	
 }
 
-void free_page_node(void* start_of_page) {
+static void free_page_node(void* start_of_page) {
 	int index = 0;
 	for(; index < BUFFER_NUM; index++) {
 		remove_page_blocks(start_of_page, index);
 	}
 }
 
-void coalesce(void* page, void* ptr, kma_size_t round_size){
+static void coalesce(void* page, void* ptr, kma_size_t round_size){
 	int index = find_block_index(round_size);
 	while(1 == 1){
 		int size = 1 << (index + 5);
@@ -390,6 +419,10 @@ void coalesce(void* page, void* ptr, kma_size_t round_size){
 }
 
 void kma_free(void* ptr, kma_size_t size) {
+	if((size + (int)sizeof(page_node_t)) > PAGESIZE) {
+		free_span_block(ptr);
+		return;
+	}
 	void* start_of_page = BASEADDR(ptr);
 	kma_size_t round_size = find_round_size(size);
 	/* If round size is PAGESIZE, directly free this page */
@@ -406,14 +439,14 @@ void kma_free(void* ptr, kma_size_t size) {
 	int k = (ptr - start_of_page) / MIN_BUFFER_SIZE;
 	int i;
 	for(i = round_size / MIN_BUFFER_SIZE; i >= 1; i--, k++) {
-		clear_bit(((page_node_t*)start_of_page)->bitmap, k);
+		clear_bit(PAGE_NODE(start_of_page)->bitmap, k);
 	}
 	/* if page can be free, No need to coalesce */
 	if(page_ready_to_free(start_of_page)) {
 		/* Remove blocks from free list */
 		free_page_node(start_of_page);
 		/* Free page */
-		free_page(((page_node_t*)start_of_page)->ptr_back);
+		free_page(PAGE_NODE(start_of_page)->ptr_back);
 		/* Free Entry page if it is the last page */
 		if(--((entry_page_node_t*)page_head->ptr)->page_count == 1) {
 			free_page(page_head);
@@ -425,4 +458,22 @@ void kma_free(void* ptr, kma_size_t size) {
 	coalesce(start_of_page, ptr, round_size);
 }
 
+/* The root of the heap is the page that holds the free lists. No
+   shrinker: kma_free gives a page back as soon as its last block is
+   freed, so BUD never holds a page a shrinker could take */
+int kma_attach(char* path) {
+	return attach_pool(path, (void**)&page_head, NULL);
+}
+
+/* Only the page that holds the free lists is tracked */
+void kma_reset() {
+	if(page_head != NULL) {
+		free_page(page_head);
+		page_head = NULL;
+	}
+}
+
+kma_allocator_t kma_bud_allocator =
+	{ "bud", kma_malloc, kma_free, kma_attach, kma_reset };
+
 #endif // KMA_BUD
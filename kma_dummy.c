@@ -71,18 +71,17 @@ void* kma_malloc(kma_size_t size)
 {
   kma_page_t* page;
   
+  if ((size + sizeof(kma_page_t*)) > PAGESIZE)
+    { // requested size too large for a page, take a span
+      return get_span_block(size);
+    }
+  
   // get one page
   page = get_page();
   
   // add a pointer to the page structure at the beginning of the page
   *((kma_page_t**)page->ptr) = page;
   
-  if ((size + sizeof(kma_page_t*)) > page->size)
-    { // requested size too large
-      free_page(page);
-      return NULL;
-    }
-  
   // check whether the BASEADDR macro works
   //for (i = 0; i < page->size; i++)
   //{
@@ -97,9 +96,29 @@ void kma_free(void* ptr, kma_size_t size)
 {
   kma_page_t* page;
   
+  if ((size + sizeof(kma_page_t*)) > PAGESIZE)
+    {
+      free_span_block(ptr);
+      return;
+    }
+  
   page = *((kma_page_t**)(ptr - sizeof(kma_page_t*)));
   
   free_page(page);
 }
 
+int kma_attach(char* path)
+{
+  // every request has a page of its own, nothing to find again
+  return attach_pool(path, NULL, NULL);
+}
+
+void kma_reset()
+{
+  // no heap, nothing to forget
+}
+
+kma_allocator_t kma_dummy_allocator =
+  { "dummy", kma_malloc, kma_free, kma_attach, kma_reset };
+
 #endif // KMA_DUMMY
@@ -0,0 +1,241 @@
+/***************************************************************************
+ *  Title: Latency Histograms
+ * -------------------------------------------------------------------------
+ *    Purpose: Log-linear histograms of operation times
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#define __KHIST_IMPL__
+
+/************System include***********************************************/
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/************Private include**********************************************/
+#include "kma_hist.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// back to back timer reads to find its overhead
+#define CALIBRATIONS 1000
+
+/************Global Variables*********************************************/
+
+static int use_tsc = FALSE;
+
+// ticks of a timer read, taken off every sample
+static kma_tick_t overhead = 0;
+
+// the timer and the clock at hist_init, to convert ticks to ns
+static kma_tick_t start_ticks = 0;
+static long long start_ns = 0;
+
+/************Function Prototypes******************************************/
+long long rawNs();
+int invariantTsc();
+int bucketOf(kma_tick_t);
+kma_tick_t bucketTop(int);
+double nsPerTick();
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void
+hist_init()
+{
+  kma_tick_t t1, t2;
+  int i;
+
+  use_tsc = invariantTsc();
+
+  overhead = ~0ULL;
+  for (i = 0; i < CALIBRATIONS; i++)
+    {
+      t1 = hist_ticks();
+      t2 = hist_ticks();
+      if (t2 - t1 < overhead)
+	overhead = t2 - t1;
+    }
+
+  start_ticks = hist_ticks();
+  start_ns = rawNs();
+}
+
+kma_tick_t
+hist_ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  if (use_tsc)
+    {
+      return __builtin_ia32_rdtsc();
+    }
+#endif
+
+  return rawNs();
+}
+
+void
+hist_add(kma_hist_t* hist, kma_tick_t start)
+{
+  kma_tick_t ticks = hist_ticks() - start;
+
+  ticks = (ticks > overhead) ? ticks - overhead : 0;
+  hist->buckets[bucketOf(ticks)]++;
+  hist->count++;
+  if (ticks > hist->max)
+    hist->max = ticks;
+}
+
+void
+hist_merge(kma_hist_t* dst, kma_hist_t* src)
+{
+  int b;
+
+  for (b = 0; b < HIST_BUCKETS; b++)
+    {
+      dst->buckets[b] += src->buckets[b];
+    }
+  dst->count += src->count;
+  if (src->max > dst->max)
+    dst->max = src->max;
+}
+
+double
+hist_percentile(kma_hist_t* hist, double q)
+{
+  unsigned long long seen = 0;
+  kma_tick_t top;
+  int b;
+
+  if (hist->count == 0)
+    {
+      return 0;
+    }
+
+  for (b = 0; b < HIST_BUCKETS - 1; b++)
+    {
+      seen += hist->buckets[b];
+      if (seen >= q * hist->count)
+	break;
+    }
+
+  top = bucketTop(b);
+  if (b == HIST_BUCKETS - 1 || top > hist->max)
+    top = hist->max;
+  return top * nsPerTick();
+}
+
+void
+hist_print(kma_hist_t* hist, char* label)
+{
+  if (hist->count == 0)
+    {
+      return;
+    }
+
+  printf("%s latency p50/p90/p99/p99.9/max (ns): %.0f/%.0f/%.0f/%.0f/%.0f, "
+	 "%llu ops\n", label, hist_percentile(hist, 0.5),
+	 hist_percentile(hist, 0.9), hist_percentile(hist, 0.99),
+	 hist_percentile(hist, 0.999), hist_percentile(hist, 1.0),
+	 hist->count);
+}
+
+long long
+rawNs()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// a time stamp counter that ticks at a constant rate through frequency
+// changes and sleep states
+int
+invariantTsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  FILE* f = fopen("/proc/cpuinfo", "r");
+  char line[4096];
+  int found = FALSE;
+
+  if (f == NULL)
+    {
+      return FALSE;
+    }
+  while (!found && fgets(line, sizeof(line), f) != NULL)
+    {
+      if (strncmp(line, "flags", 5) == 0)
+	found = strstr(line, " constant_tsc") != NULL
+	  && strstr(line, " nonstop_tsc") != NULL;
+    }
+  fclose(f);
+  return found;
+#else
+  return FALSE;
+#endif
+}
+
+// values below 2^HIST_SUBBITS get a bucket each, above that the
+// HIST_SUBBITS bits after the leading one pick the bucket
+int
+bucketOf(kma_tick_t ticks)
+{
+  int e;
+
+  if (ticks < (1 << HIST_SUBBITS))
+    {
+      return ticks;
+    }
+
+  e = 63 - __builtin_clzll(ticks);
+  if (e >= HIST_MAXBITS)
+    {
+      return HIST_BUCKETS - 1;
+    }
+  return ((e - HIST_SUBBITS + 1) << HIST_SUBBITS)
+    + ((ticks >> (e - HIST_SUBBITS)) & ((1 << HIST_SUBBITS) - 1));
+}
+
+// the highest value that falls into bucket b
+kma_tick_t
+bucketTop(int b)
+{
+  int shift;
+
+  if (b < (1 << HIST_SUBBITS))
+    {
+      return b;
+    }
+
+  shift = (b >> HIST_SUBBITS) - 1;
+  return ((kma_tick_t) ((1 << HIST_SUBBITS) + (b & ((1 << HIST_SUBBITS) - 1)))
+	  << shift) + (1ULL << shift) - 1;
+}
+
+// the rate of the timer against the clock since hist_init
+double
+nsPerTick()
+{
+  kma_tick_t ticks = hist_ticks() - start_ticks;
+
+  if (!use_tsc || ticks == 0)
+    {
+      return 1.0;
+    }
+
+  return (double) (rawNs() - start_ns) / ticks;
+}
@@ -0,0 +1,119 @@
+/***************************************************************************
+ *  Title: Latency Histograms
+ * -------------------------------------------------------------------------
+ *    Purpose: Interface for timing operations into log-linear histograms
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#ifndef __KHIST_H__
+#define __KHIST_H__
+
+/************System include***********************************************/
+
+/************Private include**********************************************/
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#undef EXTERN
+#ifdef __KHIST_IMPL__
+#define EXTERN
+#else
+#define EXTERN extern
+#endif
+
+/* every power of two of ticks is split into 2^HIST_SUBBITS equal
+   buckets, so a bucket is at most 1/16 (6%) wide relative to its
+   values. Durations of 2^HIST_MAXBITS ticks and more share the last */
+#define HIST_SUBBITS 4
+#define HIST_MAXBITS 40
+#define HIST_BUCKETS ((HIST_MAXBITS - HIST_SUBBITS + 1) << HIST_SUBBITS)
+
+typedef unsigned long long kma_tick_t;
+
+typedef struct
+{
+  unsigned long long count;
+  kma_tick_t max;
+  unsigned int buckets[HIST_BUCKETS];
+} kma_hist_t;
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Calibrates the timer
+ * ---------------------------------------------------------------------
+ *    Purpose: Picks the time stamp counter if the CPU has an invariant
+ *             one, else CLOCK_MONOTONIC_RAW, and measures the cost of
+ *             reading it, which hist_add takes off every sample. Ticks
+ *             are converted to ns against the clock read here
+ *    Input: none
+ *    Output: none
+ ***********************************************************************/
+EXTERN void hist_init();
+
+/***********************************************************************
+ *  Title: Reads the timer
+ * ---------------------------------------------------------------------
+ *    Purpose: Start of an operation for hist_add
+ *    Input: none
+ *    Output: the current tick
+ ***********************************************************************/
+EXTERN kma_tick_t hist_ticks();
+
+/***********************************************************************
+ *  Title: Records an operation
+ * ---------------------------------------------------------------------
+ *    Purpose: Counts the time since start, less the timer overhead,
+ *             into the histogram. A few instructions and no locks, so
+ *             one histogram per thread
+ *    Input: the histogram, the tick the operation started at
+ *    Output: none
+ ***********************************************************************/
+EXTERN void hist_add(kma_hist_t*, kma_tick_t start);
+
+/***********************************************************************
+ *  Title: Merges histograms
+ * ---------------------------------------------------------------------
+ *    Purpose: Adds the samples of src to dst
+ *    Input: the histograms
+ *    Output: none
+ ***********************************************************************/
+EXTERN void hist_merge(kma_hist_t* dst, kma_hist_t* src);
+
+/***********************************************************************
+ *  Title: Percentile of a histogram
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the highest value of the bucket that holds the
+ *             fraction q of the samples, the exact maximum for q = 1
+ *    Input: the histogram, the fraction
+ *    Output: the value in ns, 0 without samples
+ ***********************************************************************/
+EXTERN double hist_percentile(kma_hist_t*, double q);
+
+/***********************************************************************
+ *  Title: Prints a histogram
+ * ---------------------------------------------------------------------
+ *    Purpose: Prints p50/p90/p99/p99.9/max on one line, nothing
+ *             without samples
+ *    Input: the histogram, the line's label
+ *    Output: none
+ ***********************************************************************/
+EXTERN void hist_print(kma_hist_t*, char* label);
+
+/************External Declaration*****************************************/
+
+/**************Definition***************************************************/
+
+#endif /* __KHIST_H__ */
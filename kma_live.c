@@ -0,0 +1,179 @@
+/***************************************************************************
+ *  Title: Live Request Table
+ * -------------------------------------------------------------------------
+ *    Purpose: Open addressed hash table of the live requests of a
+ *             streamed replay
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#define __KLIVE_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/************Private include**********************************************/
+#include "kma_live.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#define LIVEBITS 10  // slots of a new table, as a power of two
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+void allocSlots(kma_live_t*, int);
+unsigned int homeSlot(kma_live_t*, unsigned int);
+void growTable(kma_live_t*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void
+live_init(kma_live_t* live)
+{
+  allocSlots(live, LIVEBITS);
+  live->num = 0;
+  live->max_num = 0;
+}
+
+int
+live_add(kma_live_t* live, unsigned int id)
+{
+  unsigned int mask, i;
+
+  assert(id != LIVE_EMPTY);
+  if (2 * (live->num + 1) > (1 << live->bits))
+    {
+      growTable(live);
+    }
+
+  mask = (1U << live->bits) - 1;
+  for (i = homeSlot(live, id); live->ids[i] != LIVE_EMPTY; i = (i + 1) & mask)
+    {
+      if (live->ids[i] == id)
+	error("request is already live", "");
+    }
+
+  live->ids[i] = id;
+  if (++live->num > live->max_num)
+    live->max_num = live->num;
+  return i;
+}
+
+int
+live_find(kma_live_t* live, unsigned int id)
+{
+  unsigned int mask = (1U << live->bits) - 1;
+  unsigned int i;
+
+  for (i = homeSlot(live, id); live->ids[i] != LIVE_EMPTY; i = (i + 1) & mask)
+    {
+      if (live->ids[i] == id)
+	return i;
+    }
+
+  return -1;
+}
+
+void
+live_remove(kma_live_t* live, int slot)
+{
+  unsigned int mask = (1U << live->bits) - 1;
+  unsigned int hole = slot;
+  unsigned int i = slot;
+  unsigned int home;
+
+  // an entry moves into the hole unless its home slot lies between the
+  // hole and where it sits now, going around the end
+  while (live->ids[i = (i + 1) & mask] != LIVE_EMPTY)
+    {
+      home = homeSlot(live, live->ids[i]);
+      if (((i - home) & mask) >= ((i - hole) & mask))
+	{
+	  live->ids[hole] = live->ids[i];
+	  live->ptrs[hole] = live->ptrs[i];
+	  live->sizes[hole] = live->sizes[i];
+	  live->values[hole] = live->values[i];
+	  hole = i;
+	}
+    }
+
+  live->ids[hole] = LIVE_EMPTY;
+  live->num--;
+}
+
+long
+live_bytes(kma_live_t* live)
+{
+  return (long) (sizeof(unsigned int) + sizeof(void*) + sizeof(int)
+		 + sizeof(void*)) << live->bits;
+}
+
+void
+live_free(kma_live_t* live)
+{
+  free(live->ids);
+  free(live->ptrs);
+  free(live->sizes);
+  free(live->values);
+}
+
+void
+allocSlots(kma_live_t* live, int bits)
+{
+  int slots = 1 << bits;
+
+  live->bits = bits;
+  live->ids = malloc(slots * sizeof(unsigned int));
+  live->ptrs = malloc(slots * sizeof(void*));
+  live->sizes = malloc(slots * sizeof(int));
+  live->values = malloc(slots * sizeof(void*));
+  assert(live->ids != NULL && live->ptrs != NULL && live->sizes != NULL
+	 && live->values != NULL);
+  memset(live->ids, 0xff, slots * sizeof(unsigned int));
+}
+
+// Fibonacci hashing, the top bits of the product pick the slot
+unsigned int
+homeSlot(kma_live_t* live, unsigned int id)
+{
+  return (id * 2654435761U) >> (32 - live->bits);
+}
+
+void
+growTable(kma_live_t* live)
+{
+  kma_live_t old = *live;
+  unsigned int mask;
+  unsigned int i, j;
+
+  allocSlots(live, old.bits + 1);
+  mask = (1U << live->bits) - 1;
+  for (i = 0; i < (1U << old.bits); i++)
+    {
+      if (old.ids[i] == LIVE_EMPTY)
+	continue;
+      for (j = homeSlot(live, old.ids[i]); live->ids[j] != LIVE_EMPTY;
+	   j = (j + 1) & mask)
+	;
+      live->ids[j] = old.ids[i];
+      live->ptrs[j] = old.ptrs[i];
+      live->sizes[j] = old.sizes[i];
+      live->values[j] = old.values[i];
+    }
+  live_free(&old);
+}
@@ -0,0 +1,116 @@
+/***************************************************************************
+ *  Title: Live Request Table
+ * -------------------------------------------------------------------------
+ *    Purpose: Interface for the table of live requests of a streamed
+ *             replay, keyed by request id
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#ifndef __KLIVE_H__
+#define __KLIVE_H__
+
+/************System include***********************************************/
+
+/************Private include**********************************************/
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#undef EXTERN
+#ifdef __KLIVE_IMPL__
+#define EXTERN
+#else
+#define EXTERN extern
+#endif
+
+/* id of an empty slot */
+#define LIVE_EMPTY 0xffffffffU
+
+/* open addressing with linear probing over parallel arrays: a lookup
+   only walks ids, 4 bytes a slot, and touches the rest of the slot it
+   finds */
+typedef struct
+{
+  unsigned int* ids;
+  void** ptrs;        /* NULL for a refused request */
+  int* sizes;
+  void** values;      /* copies of the contents, correctness mode only */
+  int bits;           /* 2^bits slots */
+  int num;
+  int max_num;
+} kma_live_t;
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Creates a live request table
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates an empty table, which grows by doubling once
+ *             it is half full
+ *    Input: the table
+ *    Output: none
+ ***********************************************************************/
+EXTERN void live_init(kma_live_t*);
+
+/***********************************************************************
+ *  Title: Adds a request
+ * ---------------------------------------------------------------------
+ *    Purpose: Takes a slot for the id, which must not be live
+ *    Input: the table, the request id
+ *    Output: the slot, valid until the next live_add or live_remove
+ ***********************************************************************/
+EXTERN int live_add(kma_live_t*, unsigned int id);
+
+/***********************************************************************
+ *  Title: Finds a request
+ * ---------------------------------------------------------------------
+ *    Purpose: Looks up the slot of a live request
+ *    Input: the table, the request id
+ *    Output: the slot, -1 if the id is not live
+ ***********************************************************************/
+EXTERN int live_find(kma_live_t*, unsigned int id);
+
+/***********************************************************************
+ *  Title: Removes a request
+ * ---------------------------------------------------------------------
+ *    Purpose: Frees the slot, moving back the entries probed past it
+ *             instead of leaving a tombstone
+ *    Input: the table, the slot
+ *    Output: none
+ ***********************************************************************/
+EXTERN void live_remove(kma_live_t*, int slot);
+
+/***********************************************************************
+ *  Title: Size of the table
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the memory the table takes now
+ *    Input: the table
+ *    Output: the size in bytes
+ ***********************************************************************/
+EXTERN long live_bytes(kma_live_t*);
+
+/***********************************************************************
+ *  Title: Destroys a live request table
+ * ---------------------------------------------------------------------
+ *    Purpose: Frees the arrays, not the requests
+ *    Input: the table
+ *    Output: none
+ ***********************************************************************/
+EXTERN void live_free(kma_live_t*);
+
+/************External Declaration*****************************************/
+
+/**************Definition***************************************************/
+
+#endif /* __KLIVE_H__ */
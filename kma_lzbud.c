@@ -48,6 +48,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <strings.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -61,8 +62,15 @@
  */
 #define MINPOWER 5 //2^5 = 32
 #define MINSIZE 32 //min block size
-#define HDRSIZE 9 //we need an array of size 9 to store 9 diff buffer sizes
-#define MAPSIZE (PAGESIZE/MINSIZE)/(sizeof(int)*8)
+//one buffer list per size from MINSIZE to PAGESIZE, 9 for 8192
+#define HDRSIZE (ffs(PAGESIZE) - MINPOWER)
+#define MAPSIZE ((PAGESIZE/MINSIZE)/(sizeof(int)*8))
+//the structs below end in arrays sized from PAGESIZE
+#define PGHDRSIZE (sizeof(pg_hdr_t) + MAPSIZE * sizeof(unsigned int))
+#define CTRLSIZE (sizeof(mem_ctrl_t) + HDRSIZE * sizeof(bf_lst_t))
+//the back pointer and pg_hdr_t of a page take the smallest buddy block
+//they fit in, the one of the page's color (HDROFFSET)
+#define HDRSPAN (1 << (32 - __builtin_clz(sizeof(kma_page_t*) + PGHDRSIZE - 1)))
 
 typedef struct blk_ptr{
   struct blk_ptr* next;
@@ -71,10 +79,10 @@ typedef struct blk_ptr{
 //2 int is sizeof(int) = 8 *4 = 32 byte
 typedef struct pg_hdr{
   kma_page_t* this;
-  //bitmap to decide if buddy is free.
-  unsigned int bitmap[MAPSIZE];
   struct pg_hdr* prev;
   struct pg_hdr* next;
+  //bitmap to decide if buddy is free, MAPSIZE words.
+  unsigned int bitmap[];
 } pg_hdr_t;
 
 //buffer list struct
@@ -89,44 +97,50 @@ typedef struct {
 typedef struct {
   int allocated;
   int freed;
-  bf_lst_t free_list[HDRSIZE];
   pg_hdr_t* page_list;
+  bf_lst_t free_list[]; //HDRSIZE lists
 } mem_ctrl_t;
 
 /************Global Variables*********************************************/
 static kma_page_t* entry_page = NULL;
 /************Function Prototypes******************************************/
-mem_ctrl_t* pg_master();
-int next_power_of_two(int);
+static mem_ctrl_t* pg_master();
+static int next_power_of_two(int);
 void* kma_malloc(kma_size_t);
 void kma_free(void*, kma_size_t);
-void* find_fit(kma_size_t);
-void init_page();
-void* get_new_free_block(kma_size_t);
-void add_to_free_list(void*, int);
-void delete_block(void*, int);
-void set_bit(unsigned int[], int);
-void unset_bit(unsigned int[], int);
-int get_bit(unsigned int[], int);
-int get_pos(void*);
-int get_index(int);
-void set_bitmap(void*, kma_size_t);
-void unset_bitmap(void*, kma_size_t);
-void* find_buddy(void*, int);
-bool is_free(void*, int);
-bool is_locally_free(void*, int);
-void* find_locally_free_block(kma_size_t);
-void coalesce(void*, kma_size_t);
-void split_block(kma_size_t, int);
+static void* find_fit(kma_size_t);
+static void init_page();
+static void* get_new_free_block(kma_size_t);
+static void add_to_free_list(void*, int);
+static void delete_block(void*, int);
+static void set_bit(unsigned int[], int);
+static void unset_bit(unsigned int[], int);
+static int get_bit(unsigned int[], int);
+static int get_pos(void*);
+static pg_hdr_t* page_header(void*);
+static int get_index(int);
+static void set_bitmap(void*, kma_size_t);
+static void unset_bitmap(void*, kma_size_t);
+static void* find_buddy(void*, int);
+static bool is_free(void*, int);
+static bool is_locally_free(void*, int);
+static void* find_locally_free_block(kma_size_t);
+static void coalesce(void*, kma_size_t);
+static void split_block(kma_size_t, int);
+static void free_all();
+static kma_page_t* next_page(void**);
+static bool page_unused(pg_hdr_t*);
+static bool page_empty(pg_hdr_t*);
+static int shrink_pages(int);
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
 //The manager of the allocater, keep tracking the free_list and page_list
-mem_ctrl_t* pg_master(){
+static mem_ctrl_t* pg_master(){
   return (mem_ctrl_t*)((void*)entry_page->ptr + sizeof(kma_page_t*));
 }
 //get the next power of two of the size
-int next_power_of_two(int n) {
+static int next_power_of_two(int n) {
   int p = 1;
   if (n && !(n & (n-1)))
     return n;
@@ -139,10 +153,17 @@ int next_power_of_two(int n) {
 //---------KMA_MALLOC-----------//
 void* kma_malloc(kma_size_t size) {
   if (size + sizeof(void*) > PAGESIZE)  
-    return NULL;
+    return get_span_block(size);
 
   if (entry_page == NULL)
     init_page();
+  //too large to sit behind a page header, give it a page of its own
+  if (OWN_PAGE(size, HDRSPAN, PGHDRSIZE)) {
+    kma_page_t* page = get_page();
+    *((kma_page_t**)page->ptr) = page;
+    pg_master()->allocated++;
+    return (void*)page->ptr + sizeof(kma_page_t*);
+  }
   if (size < MINSIZE)
   	size = MINSIZE;
   //all operations after round up size can have a benefit for not caring about the size.
@@ -155,14 +176,15 @@ void* kma_malloc(kma_size_t size) {
   return block;
 }
 //initialize the entry_page
-void init_page() {
+static void init_page() {
+  page_shrinker(shrink_pages);
   kma_page_t* new_page = get_page();
   entry_page = new_page;
   *((kma_page_t**)new_page->ptr) = new_page;
 
   mem_ctrl_t* controller = pg_master();
   
-  controller->page_list = (pg_hdr_t*)((void*)controller + sizeof(mem_ctrl_t));
+  controller->page_list = (pg_hdr_t*)((void*)controller + CTRLSIZE);
   // use this to point to the kma_page_t struct for free_page()
   controller->page_list->this = (kma_page_t*)new_page->ptr;
   controller->page_list->prev = NULL;
@@ -178,7 +200,7 @@ void init_page() {
   //to store some info of the page and allocator
   //we round up the size to power of two
   //and add (2^i > pre_alloc_size) to free_list
-  int pre_alloc = sizeof(kma_page_t*) + sizeof(mem_ctrl_t) + sizeof(pg_hdr_t);
+  int pre_alloc = sizeof(kma_page_t*) + CTRLSIZE + PGHDRSIZE;
   pre_alloc = next_power_of_two(pre_alloc);
   void* start = (void*)new_page->ptr + pre_alloc;
   void* end = (void*)new_page->ptr + PAGESIZE;
@@ -203,7 +225,7 @@ void init_page() {
 //i = 0: 0-31
 //i = 1: 32-63...
 //set one bit to one.
-void set_bit(unsigned int bitmap[], int pos) {
+static void set_bit(unsigned int bitmap[], int pos) {
 	int i = pos/(sizeof(int)*8);
 	int offset = pos%(sizeof(int)*8);
 	unsigned int flag = 1;
@@ -211,7 +233,7 @@ void set_bit(unsigned int bitmap[], int pos) {
 	bitmap[i] = bitmap[i] | flag;
 }
 //set one bit to zero.
-void unset_bit(unsigned int bitmap[], int pos) {
+static void unset_bit(unsigned int bitmap[], int pos) {
 	int i = pos/(sizeof(int)*8);
 	int offset = pos%(sizeof(int)*8);
 	unsigned int flag = 1;
@@ -220,7 +242,7 @@ void unset_bit(unsigned int bitmap[], int pos) {
 	bitmap[i] = bitmap[i] & flag;
 }
 //get the value of one bit
-int get_bit(unsigned int bitmap[], int pos) {
+static int get_bit(unsigned int bitmap[], int pos) {
 	int i = pos/(sizeof(int)*8);
 	int offset = pos%(sizeof(int)*8);
 	unsigned int flag = 1;
@@ -231,37 +253,45 @@ int get_bit(unsigned int bitmap[], int pos) {
 		return 0;
 }
 //get the start position of ptr in the bitmap
-int get_pos(void* ptr) {
+static int get_pos(void* ptr) {
 	return (ptr - BASEADDR(ptr))/MINSIZE;
 }
+//the header of the page ptr points into, behind the mem_ctrl_t in the
+//entry page and in the buddy block of its color in every other page
+static pg_hdr_t* page_header(void* ptr) {
+	void* page = BASEADDR(ptr);
+	if (page == entry_page->ptr)
+		return (pg_hdr_t*)(page + sizeof(kma_page_t*) + CTRLSIZE);
+	return (pg_hdr_t*)(page + HDROFFSET(page, HDRSPAN) + sizeof(kma_page_t*));
+}
 //set the bitmap for one blk, set all their corresponding bit to one.
-void set_bitmap(void* blk, kma_size_t size) {
+static void set_bitmap(void* blk, kma_size_t size) {
 	size = next_power_of_two(size);
-	pg_hdr_t* current_page;
-	if (BASEADDR(blk) == entry_page->ptr)
-		current_page = (pg_hdr_t*)(BASEADDR(blk) + sizeof(kma_page_t*) + sizeof(mem_ctrl_t));
-	else
-		current_page = (pg_hdr_t*)(BASEADDR(blk) + sizeof(kma_page_t*));
+	//a whole page block starts behind the header and has no buddy,
+	//its bits would run past the end of the bitmap
+	if (size >= PAGESIZE)
+		return;
+	pg_hdr_t* current_page = page_header(blk);
 	int pos = get_pos(blk);//the start positon on the bitmap;
 	int i;
 	for (i = 0; i < size/MINSIZE; i++)
 		set_bit(current_page->bitmap, pos+i);
 }
 //unset the bitmap for one blk, set all their corresponding bit to zero.
-void unset_bitmap(void* blk, kma_size_t size) {
+static void unset_bitmap(void* blk, kma_size_t size) {
 	size = next_power_of_two(size);
-	pg_hdr_t* current_page;
-	if (BASEADDR(blk) == entry_page->ptr)
-		current_page = (pg_hdr_t*)(BASEADDR(blk) + sizeof(kma_page_t*) + sizeof(mem_ctrl_t));
-	else
-		current_page = (pg_hdr_t*)(BASEADDR(blk) + sizeof(kma_page_t*));
+	//a whole page block starts behind the header and has no buddy,
+	//its bits would run past the end of the bitmap
+	if (size >= PAGESIZE)
+		return;
+	pg_hdr_t* current_page = page_header(blk);
 	int pos = get_pos(blk);//the start positon on the bitmap;
 	int i;
 	for (i = 0; i < size/MINSIZE; i++)
 		unset_bit(current_page->bitmap, pos+i);
 }
 //get the index for each size. e.g. index(16) = 0, index(32) = 1.
-int get_index(int n) {
+static int get_index(int n) {
   n = next_power_of_two(n);
   int count = 0;
   while(n) {
@@ -272,12 +302,8 @@ int get_index(int n) {
 }
 //if the corresponding bits of request block in bitmap are all ones.
 //the result is versus to the is_free
-bool is_locally_free(void* ptr, int size) {
-	pg_hdr_t* current_page;
-	if (BASEADDR(ptr) == entry_page->ptr)
-		current_page = (pg_hdr_t*)(BASEADDR(ptr) + sizeof(kma_page_t*) + sizeof(mem_ctrl_t));
-	else
-		current_page = (pg_hdr_t*)(BASEADDR(ptr) + sizeof(kma_page_t*));
+static bool is_locally_free(void* ptr, int size) {
+	pg_hdr_t* current_page = page_header(ptr);
 	int offset = (ptr-BASEADDR(ptr))/MINSIZE;
 	int i;
 	int flag;
@@ -294,7 +320,7 @@ bool is_locally_free(void* ptr, int size) {
 //we split the larger block into two and add them into free_list (recursively)
 //until we can find the request size block. 
 //else if there is no larger block in the free_list for this request, get a new page.
-void* find_fit(kma_size_t size) {
+static void* find_fit(kma_size_t size) {
   mem_ctrl_t* controller = pg_master();
 
   int ind = get_index(size);
@@ -328,7 +354,7 @@ void* find_fit(kma_size_t size) {
   }
   return blk;
 }
-void split_block(kma_size_t size, int index) {
+static void split_block(kma_size_t size, int index) {
 	mem_ctrl_t* controller = pg_master();
 	bf_lst_t lst = controller->free_list[index];
 	blk_ptr_t* current = lst.next;
@@ -340,7 +366,7 @@ void split_block(kma_size_t size, int index) {
 	add_to_free_list((void*)current, sz);
 }
 //add block to the free_list
-void add_to_free_list(void* block, int size) {
+static void add_to_free_list(void* block, int size) {
   mem_ctrl_t* controller = pg_master();
   int ind = get_index(size);
   ((blk_ptr_t*)block)->next = controller->free_list[ind].next;
@@ -348,12 +374,12 @@ void add_to_free_list(void* block, int size) {
   return;
 }
 //get a new free block
-void* get_new_free_block(kma_size_t size) {;
+static void* get_new_free_block(kma_size_t size) {;
   int ind = get_index(size);
   mem_ctrl_t* controller = pg_master();
 
   int i;
-  //check the larger size buffer list, not include 8192
+  //check the larger size buffer list, not include PAGESIZE
   for (i = ind + 1; i < HDRSIZE - 1; i++) {
   	bf_lst_t lst = controller->free_list[i];
   	if (lst.next) {
@@ -366,9 +392,12 @@ void* get_new_free_block(kma_size_t size) {;
   //for not including mem_ctrl_t structure any more.
   //so the pre_alloc_space is smaller than entry_page
   kma_page_t* new_page = get_page();
-  *((kma_page_t**)new_page->ptr) = new_page;
-  pg_hdr_t* current = (pg_hdr_t*)((void*)new_page->ptr + sizeof(kma_page_t*));
-  current->this = (kma_page_t*)(new_page->ptr);
+  unsigned long offset = HDROFFSET(new_page->ptr, HDRSPAN);
+  void* hdr = (void*)new_page->ptr + offset;
+  *((kma_page_t**)hdr) = new_page;
+  pg_hdr_t* current = (pg_hdr_t*)(hdr + sizeof(kma_page_t*));
+  //where the back pointer is, for free_all
+  current->this = (kma_page_t*)hdr;
   current->next = NULL;
   //add this page to page_list
   pg_hdr_t* previous = controller->page_list;
@@ -382,35 +411,35 @@ void* get_new_free_block(kma_size_t size) {;
       previous = previous->next;
   }
 
-  if (size > 4096) {
-  	// if size > 4096, just return this page to the request
-    return (void*)((void*)current + sizeof(pg_hdr_t));
+  if (size > PAGESIZE/2) {
+  	// if size > PAGESIZE/2, just return this page to the request
+  	// all bits set, so that the shrinker leaves it alone
+  	for (i = 0; i < MAPSIZE; i++) {
+  		current->bitmap[i] = ~0U;
+  	}
+    return (void*)((void*)current + PGHDRSIZE);
   }
   else {
-  	int pre_alloc = sizeof(kma_page_t*) + sizeof(pg_hdr_t);
-	  pre_alloc = next_power_of_two(pre_alloc);
-	  void* start = (void*)new_page->ptr + pre_alloc;
-	  void* end = (void*)new_page->ptr + PAGESIZE;
-	  int sz = pre_alloc;
-	  while (start < end) {
-	  	add_to_free_list(start, sz);
-	  	start += sz;
-	  	sz = sz * 2;  	
+  	int pre_alloc = HDRSPAN;
+	  int sz;
+	  //the buddy of every block that contains the header is free
+	  for (sz = pre_alloc; sz < PAGESIZE; sz = sz * 2) {
+	  	add_to_free_list((void*)new_page->ptr + ((offset & ~(sz - 1)) ^ sz), sz);
 	  }
 	  //init bitmap
-	  int pre_alloc_pos = pre_alloc/MINSIZE;
+	  int pre_alloc_pos = offset/MINSIZE;
 	  for (i = 0; i < MAPSIZE; i++) {
 	  	current->bitmap[i] = 0;
 	  }
 	  //set bitmap
-	  for (i = 0; i < pre_alloc_pos; i++) {
+	  for (i = pre_alloc_pos; i < pre_alloc_pos + pre_alloc/MINSIZE; i++) {
 	  	set_bit(current->bitmap, i);
 	  }
 	  return find_fit(size); 
   }
 }
 //find buddy of request block, return the buddy address
-void* find_buddy(void* ptr, int size) {
+static void* find_buddy(void* ptr, int size) {
 	unsigned long offset = ptr-(BASEADDR(ptr));
 	int i = get_index(size);
 	unsigned long bud = offset ^ (1UL << (i+MINPOWER));
@@ -420,12 +449,8 @@ void* find_buddy(void* ptr, int size) {
 //check if the corresponding bits of request block in bitmap are all zero.
 //if all zeros, return true, means this block is globaly free.
 //else this block is locally free(is_locally_freefor lzbud) 
-bool is_free(void* ptr, int size) {
-	pg_hdr_t* current_page;
-	if (BASEADDR(ptr) == entry_page->ptr)
-		current_page = (pg_hdr_t*)(BASEADDR(ptr) + sizeof(kma_page_t*) + sizeof(mem_ctrl_t));
-	else
-		current_page = (pg_hdr_t*)(BASEADDR(ptr) + sizeof(kma_page_t*));
+static bool is_free(void* ptr, int size) {
+	pg_hdr_t* current_page = page_header(ptr);
 	int offset = (ptr-BASEADDR(ptr))/MINSIZE;
 	int i;
 	int flag;
@@ -440,7 +465,7 @@ bool is_free(void* ptr, int size) {
 //when you coalesce two block, you need to delete two blocks
 //after that, add one larger to the free_list
 //no need to set or unset bitmap
-void delete_block(void* ptr, int size) {
+static void delete_block(void* ptr, int size) {
 	mem_ctrl_t* controller = pg_master();
 	int i = get_index(size);
 	bf_lst_t lst = controller->free_list[i];
@@ -468,7 +493,11 @@ void delete_block(void* ptr, int size) {
 	} 
 }
 //coalesce buddy blocks recursively
-void coalesce(void* ptr, kma_size_t size) {
+static void coalesce(void* ptr, kma_size_t size) {
+	//a whole page block has no buddy inside its page, and the page next
+	//to it need not belong to us (or even be mapped)
+	if (size >= PAGESIZE)
+		return;
 	void* bud = find_buddy(ptr, size);
 	if (is_free(bud, size)) {
 		delete_block(ptr, size);
@@ -479,9 +508,9 @@ void coalesce(void* ptr, kma_size_t size) {
 		else
 			new_blk = bud;
 		int new_size = 2 * size;
-		//we don't want to care about 8192
+		//we don't want to care about PAGESIZE
 		//just ignore it!
-		if (new_size > 4096)
+		if (new_size > PAGESIZE/2)
 			return;
 		add_to_free_list(new_blk, new_size);
 		coalesce(new_blk, new_size);
@@ -489,7 +518,7 @@ void coalesce(void* ptr, kma_size_t size) {
 }
 //find a locally_free_block of a given size
 //or return NULL
-void* find_locally_free_block(kma_size_t size) {
+static void* find_locally_free_block(kma_size_t size) {
 	mem_ctrl_t* controller = pg_master();
 	int ind = get_index(size);
 	bf_lst_t lst = controller->free_list[ind];
@@ -504,10 +533,22 @@ void* find_locally_free_block(kma_size_t size) {
 
 void kma_free(void* ptr, kma_size_t size)
 { 
+	if (size + sizeof(void*) > PAGESIZE) {
+		free_span_block(ptr);
+		return;
+	}
+	mem_ctrl_t* controller = pg_master();
+	if (OWN_PAGE(size, HDRSPAN, PGHDRSIZE)) {
+		free_page(*((kma_page_t**)ptr - 1));
+		controller->freed++;
+		if (controller->freed == controller->allocated){
+			free_all();
+		}
+		return;
+	}
 	if (size < MINSIZE) 
 		size = MINSIZE;
 	size = next_power_of_two(size);
-	mem_ctrl_t* controller = pg_master();
 	int ind = get_index(size);
 	int slck = controller->free_list[ind].slack;
 	//if slack >= 2
@@ -547,15 +588,123 @@ void kma_free(void* ptr, kma_size_t size)
   //if free operations and alloc operations are the same amounts
   //free all pages
   if (controller->freed == controller->allocated){
-    pg_hdr_t* current_page = controller->page_list;
-  	while (current_page) {
-    	kma_page_t* page = *(kma_page_t**)current_page->this;
-    	current_page = current_page->next;
-    	free_page(page);
-  	}
-  	entry_page = NULL;
+    free_all();
   }
   return;
 }
 
+//give every page on the page_list back
+static void free_all() {
+  free_page_list(pg_master()->page_list, next_page);
+  entry_page = NULL;
+}
+
+//free_page_list walker: this points at the page's back pointer
+static kma_page_t* next_page(void** cursor) {
+  pg_hdr_t* page = (pg_hdr_t*)*cursor;
+  *cursor = page->next;
+  return *(kma_page_t**)page->this;
+}
+
+//mem_ctrl sits in the entry page, the rest is reachable from there
+int kma_attach(char* path) {
+  return attach_pool(path, (void**)&entry_page, shrink_pages);
+}
+
+void kma_reset() {
+  if (entry_page != NULL)
+    free_all();
+}
+
+//a split page is unused once only the bits of its header are set
+static bool page_unused(pg_hdr_t* page) {
+	int first = HDROFFSET(BASEADDR(page), HDRSPAN)/MINSIZE;
+	int i;
+	for (i = 0; i < PAGESIZE/MINSIZE; i++) {
+		if (get_bit(page->bitmap, i) != (i >= first && i < first + HDRSPAN/MINSIZE))
+			return FALSE;
+	}
+	return TRUE;
+}
+//the shrinker clears the whole bitmap of the pages it gives back, pages
+//in use always have the bits of their header set
+static bool page_empty(pg_hdr_t* page) {
+	int i;
+	for (i = 0; i < MAPSIZE; i++) {
+		if (page->bitmap[i] != 0)
+			return FALSE;
+	}
+	return TRUE;
+}
+//shrinker: free the locally free blocks globally, so that they coalesce,
+//then give back the whole pages on the free list and the split pages
+//that are left with their header only. The entry page stays
+static int shrink_pages(int npages) {
+	if (entry_page == NULL)
+		return 0;
+	mem_ctrl_t* controller = pg_master();
+	pg_hdr_t* page;
+	blk_ptr_t** link;
+	void* blk;
+	int found = 0;
+	int i, sz;
+	for (i = 0; i < HDRSIZE - 1; i++) {
+		sz = 1 << (i + MINPOWER);
+		while ((blk = find_locally_free_block(sz)) != NULL) {
+			unset_bitmap(blk, sz);
+			coalesce(blk, sz);
+		}
+		controller->free_list[i].slack = 0;
+	}
+	//pick the pages, an empty bitmap marks them
+	link = &controller->free_list[HDRSIZE - 1].next;
+	while (*link && found < npages) {
+		page = page_header(*link);
+		for (i = 0; i < MAPSIZE; i++)
+			page->bitmap[i] = 0;
+		*link = (*link)->next;
+		found++;
+	}
+	for (page = controller->page_list->next; page && found < npages; page = page->next) {
+		if (page_unused(page)) {
+			for (i = 0; i < MAPSIZE; i++)
+				page->bitmap[i] = 0;
+			found++;
+		}
+	}
+	if (found == 0)
+		return 0;
+	for (i = 0; i < HDRSIZE - 1; i++) {
+		link = &controller->free_list[i].next;
+		while (*link) {
+			if (page_empty(page_header(*link)))
+				*link = (*link)->next;
+			else
+				link = &(*link)->next;
+		}
+	}
+	kma_page_t* batch[PAGEBATCH];
+	int n = 0;
+	page = controller->page_list->next;
+	while (page) {
+		pg_hdr_t* next = page->next;
+		if (page_empty(page)) {
+			page->prev->next = next;
+			if (next)
+				next->prev = page->prev;
+			batch[n++] = *(kma_page_t**)page->this;
+			if (n == PAGEBATCH) {
+				free_pages(batch, n);
+				n = 0;
+			}
+		}
+		page = next;
+	}
+	free_pages(batch, n);
+	return found;
+}
+
+kma_allocator_t kma_lzbud_allocator =
+  { "lzbud", kma_malloc, kma_free, kma_attach, kma_reset };
+
 #endif // KMA_LZBUD
@@ -48,6 +48,8 @@
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <strings.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -61,7 +63,10 @@
  */
 #define MINPOWER 4 //2^4 = 16
 #define MINSIZE 16 //min block size
-#define HDRSIZE 10 //we need an array of size 10 to store 10 diff buffer sizes
+//one buffer list per size from MINSIZE to PAGESIZE, 10 for 8192
+#define HDRSIZE (ffs(PAGESIZE) - MINPOWER)
+//mem_ctrl_t ends in its HDRSIZE buffer lists
+#define CTRLSIZE (sizeof(mem_ctrl_t) + HDRSIZE * sizeof(bf_lst_t))
 
 typedef struct blk_ptr{
   struct blk_ptr* next;
@@ -74,6 +79,8 @@ typedef struct pg_hdr{
   struct pg_hdr* next;
   //the space we can use for this page
   int f_size; 
+  //blocks of this page in use, the shrinker gives back pages at 0
+  int used;
 } pg_hdr_t;
 
 //buffer list struct
@@ -86,32 +93,36 @@ typedef struct {
 typedef struct {
   int allocated;
   int freed;
-  bf_lst_t free_list[HDRSIZE];
   pg_hdr_t* page_list;
+  bf_lst_t free_list[];
 } mem_ctrl_t;
 
 /************Global Variables*********************************************/
 static kma_page_t* entry_page = NULL;
 /************Function Prototypes******************************************/
-mem_ctrl_t* pg_master();
-int next_power_of_two(int);
+static mem_ctrl_t* pg_master();
+static int next_power_of_two(int);
 void* kma_malloc(kma_size_t);
 void kma_free(void*, kma_size_t);
-void* find_fit(kma_size_t);
-void init_page();
-void* get_new_free_block(kma_size_t);
-void add_to_free_list(void*, int);
-void free_all();
+static void* find_fit(kma_size_t);
+static void init_page();
+static void* get_new_free_block(kma_size_t);
+static void add_to_free_list(void*, int);
+static void free_front(void*, unsigned long);
+static void free_all();
+static kma_page_t* next_page(void**);
+static pg_hdr_t* page_header(void*);
+static int shrink_pages(int);
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
 //The manager of the allocater, keep tracking the free_list and page_list
-mem_ctrl_t* pg_master(){
+static mem_ctrl_t* pg_master(){
   return (mem_ctrl_t*)((void*)entry_page->ptr + sizeof(kma_page_t*));
 }
 
 //get the next power of two of the size
-int next_power_of_two(int n) {
+static int next_power_of_two(int n) {
   int p = 1;
   if (n && !(n & (n-1)))
     return n;
@@ -126,10 +137,17 @@ int next_power_of_two(int n) {
 //need to consider block pointer for extra space
 void* kma_malloc(kma_size_t size) {
   if (size + sizeof(void*) > PAGESIZE)  
-    return NULL;
+    return get_span_block(size);
 
   if (entry_page == NULL)
     init_page();
+  //too large to sit behind a page header, give it a page of its own
+  if (OWN_PAGE(size, CACHELINE, sizeof(pg_hdr_t))) {
+    kma_page_t* page = get_page();
+    *((kma_page_t**)page->ptr) = page;
+    pg_master()->allocated++;
+    return (void*)page->ptr + sizeof(kma_page_t*);
+  }
 
   //size need to consider the header of block
   size += sizeof(blk_ptr_t);
@@ -145,20 +163,22 @@ void* kma_malloc(kma_size_t size) {
 }
 
 //initialize the entry_page
-void init_page() {
+static void init_page() {
+  page_shrinker(shrink_pages);
   kma_page_t* new_page = get_page();
   entry_page = new_page;
   *((kma_page_t**)new_page->ptr) = new_page;
 
   mem_ctrl_t* controller = pg_master();
   
-  controller->page_list = (pg_hdr_t*)((void*)new_page->ptr + sizeof(kma_page_t*) + sizeof(mem_ctrl_t));
+  controller->page_list = (pg_hdr_t*)((void*)new_page->ptr + sizeof(kma_page_t*) + CTRLSIZE);
   // use this to point to the kma_page_t struct for free_page()
   controller->page_list->this = (kma_page_t*)new_page->ptr;
   controller->page_list->prev = NULL;
   controller->page_list->next = NULL;
+  controller->page_list->used = 0;
   //the free space for this page
-  controller->page_list->f_size = PAGESIZE - sizeof(kma_page_t*) - sizeof(mem_ctrl_t) - sizeof(pg_hdr_t);
+  controller->page_list->f_size = PAGESIZE - sizeof(kma_page_t*) - CTRLSIZE - sizeof(pg_hdr_t);
   int i;
   //initialize the free_list for each buffer size
   for (i = 0; i < HDRSIZE; i++) {
@@ -169,7 +189,7 @@ void init_page() {
   controller->freed = 0;
 }
 //get the index for each size. e.g. index(16) = 0, index(32) = 1.
-int get_index(int n) {
+static int get_index(int n) {
   n = next_power_of_two(n);
   int count = 0;
   while(n) {
@@ -181,7 +201,7 @@ int get_index(int n) {
 //find the free block in the corresponding buffer size list of free_list.
 //if the free block not found, to request a new free block in this page.
 //else if the page has not enough space for this request, get a new page.
-void* find_fit(kma_size_t size) {
+static void* find_fit(kma_size_t size) {
   mem_ctrl_t* controller = pg_master();
 
   int ind = get_index(size);
@@ -191,6 +211,7 @@ void* find_fit(kma_size_t size) {
     blk = (void*)lst.next;
     //remove from free_list
     controller->free_list[ind].next = controller->free_list[ind].next->next;
+    page_header(blk)->used++;
   }
   else {
     blk = get_new_free_block(size);
@@ -199,15 +220,16 @@ void* find_fit(kma_size_t size) {
   return blk;
 }
 //get a new free block.
-void* get_new_free_block(kma_size_t size) {
+static void* get_new_free_block(kma_size_t size) {
   mem_ctrl_t* controller = pg_master();
   pg_hdr_t* current_page = controller->page_list;
 
   while (current_page) {
-    //check if request size <= 4096 and this page has enough size
-    if (size <= 4096 && current_page->f_size > size) {
+    //check if request size <= PAGESIZE/2 and this page has enough size
+    if (size <= PAGESIZE/2 && current_page->f_size > size) {
       current_page->f_size = current_page->f_size - size;
-      return (void*)((void*)current_page->this + (PAGESIZE - current_page->f_size) - size);
+      current_page->used++;
+      return (void*)(BASEADDR(current_page) + (PAGESIZE - current_page->f_size) - size);
     }
     else 
       current_page = current_page->next;
@@ -216,11 +238,16 @@ void* get_new_free_block(kma_size_t size) {
   //get a new page, because it is not the enrty_page, so we can get extra space
   //for not including mem_ctrl_t structure any more.
   kma_page_t* new_page = get_page();
-  *((kma_page_t**)new_page->ptr) = new_page;
-  pg_hdr_t* current = (pg_hdr_t*)((void*)new_page->ptr + sizeof(kma_page_t*));
-  current->this = (kma_page_t*)(new_page->ptr);
+  unsigned long offset = HDROFFSET(new_page->ptr, CACHELINE);
+  void* hdr = (void*)new_page->ptr + offset;
+  *((kma_page_t**)hdr) = new_page;
+  pg_hdr_t* current = (pg_hdr_t*)(hdr + sizeof(kma_page_t*));
+  //where the back pointer is, for free_all
+  current->this = (kma_page_t*)hdr;
   current->next = NULL;
-  current->f_size = PAGESIZE - sizeof(kma_page_t*) - sizeof(pg_hdr_t);
+  current->f_size = PAGESIZE - offset - sizeof(kma_page_t*) - sizeof(pg_hdr_t);
+  current->used = 1;
+  free_front(new_page->ptr, offset);
   //add this page to the page_list
   pg_hdr_t* previous = controller->page_list;
   while (previous) {
@@ -233,8 +260,8 @@ void* get_new_free_block(kma_size_t size) {
       previous = previous->next;
   }
 
-  if (size > 4096) {
-    // if size > 4096, just return this page to the request
+  if (size > PAGESIZE/2) {
+    // if size > PAGESIZE/2, just return this page to the request
     current->f_size = 0;
     return (void*)((void*)current + sizeof(pg_hdr_t));
   }
@@ -243,8 +270,18 @@ void* get_new_free_block(kma_size_t size) {
     return (void*)((void*)new_page->ptr + (PAGESIZE - current->f_size) - size); 
   }
 }
+//hand the space in front of a colored header to the free_list
+static void free_front(void* page, unsigned long offset) {
+  int sz;
+  for (sz = PAGESIZE/2; sz >= MINSIZE; sz /= 2) {
+    if (offset & sz) {
+      offset -= sz;
+      add_to_free_list(page + offset, sz);
+    }
+  }
+}
 //add block to the free_list
-void add_to_free_list(void* block, int size) {
+static void add_to_free_list(void* block, int size) {
   mem_ctrl_t* controller = pg_master();
   int ind = get_index(size);
   // we just add the free_block in front of the free_list
@@ -255,6 +292,19 @@ void add_to_free_list(void* block, int size) {
 
 void kma_free(void* ptr, kma_size_t size)
 { 
+  if (size + sizeof(void*) > PAGESIZE) {
+    free_span_block(ptr);
+    return;
+  }
+  mem_ctrl_t* controller = pg_master();
+  if (OWN_PAGE(size, CACHELINE, sizeof(pg_hdr_t))) {
+    free_page(*((kma_page_t**)ptr - 1));
+    controller->freed++;
+    if (controller->freed == controller->allocated){
+      free_all();
+    }
+    return;
+  }
   size += sizeof(blk_ptr_t);
   if (size < MINSIZE) 
     size = MINSIZE;
@@ -262,19 +312,68 @@ void kma_free(void* ptr, kma_size_t size)
   size = next_power_of_two(size);
 
   add_to_free_list(ptr, size);
-  mem_ctrl_t* controller = pg_master();
+  page_header(ptr)->used--;
   controller->freed++;
   //if free operations and alloc operations are the same amounts
   //free all pages
   if (controller->freed == controller->allocated){
-    pg_hdr_t* current_page = controller->page_list;
-    while (current_page) {
-      kma_page_t* page = *(kma_page_t**)current_page->this;
-      current_page = current_page->next;
-      free_page(page);
-    }
-    entry_page = NULL;
+    free_all();
   }
   return;
 }
+//give every page on the page_list back
+static void free_all() {
+  free_page_list(pg_master()->page_list, next_page);
+  entry_page = NULL;
+}
+
+//free_page_list walker: this points at the page's back pointer
+static kma_page_t* next_page(void** cursor) {
+  pg_hdr_t* page = (pg_hdr_t*)*cursor;
+  *cursor = page->next;
+  return *(kma_page_t**)page->this;
+}
+
+//the free lists live in the entry page, keep it across restarts
+int kma_attach(char* path) {
+  return attach_pool(path, (void**)&entry_page, shrink_pages);
+}
+
+void kma_reset() {
+  if (entry_page != NULL)
+    free_all();
+}
+
+//the header of the page ptr points into, behind the mem_ctrl_t in the
+//entry page and one cache line per color into every other page
+static pg_hdr_t* page_header(void* ptr) {
+  void* page = BASEADDR(ptr);
+  if (page == entry_page->ptr)
+    return pg_master()->page_list;
+  return (pg_hdr_t*)(page + HDROFFSET(page, CACHELINE) + sizeof(kma_page_t*));
+}
+
+//shrinker: give back the pages with no block in use, once their blocks
+//are off the free lists. The entry page holds the lists and stays
+static int shrink_pages(int npages) {
+  if (entry_page == NULL)
+    return 0;
+  mem_ctrl_t* controller = pg_master();
+  kma_page_layout_t layout = {
+    .pages = controller->page_list->next,
+    .next_at = offsetof(pg_hdr_t, next),
+    .prev_at = offsetof(pg_hdr_t, prev),
+    .used_at = offsetof(pg_hdr_t, used),
+    .page_at = offsetof(pg_hdr_t, this),
+    .lists = &controller->free_list[0].next,
+    .nlists = HDRSIZE,
+    .stride = sizeof(bf_lst_t),
+    .header = (void* (*)(void*))page_header
+  };
+  return shrink_page_list(&layout, npages);
+}
+
+kma_allocator_t kma_p2fl_allocator =
+  { "p2fl", kma_malloc, kma_free, kma_attach, kma_reset };
+
 #endif // KMA_P2FL
@@ -48,6 +48,7 @@
  ***************************************************************************/
 
  #define __KPAGE_IMPL__
+#define _GNU_SOURCE   /* memfd_create */
 
 /************System include***********************************************/
 #include <assert.h>
@@ -55,6 +56,17 @@
 #include <string.h>
 #include <strings.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <sched.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -67,16 +79,310 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << 26)
+#endif
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+// the chunk directory is a two level radix tree over (address >> CHUNKSHIFT)
+#define DIRBITS 13
+#define DIRSIZE (1 << DIRBITS)
+
+// number of completely free chunks we keep mapped before unmapping more
+#define KEEPCHUNKS 1
+
+// pages a thread caches in front of the global free list
+#define MAGSIZE 32
+
+// descriptor slots per chunk, enough for the smallest page size. Slot
+// stride is constant so that index / SLOTPAGES is a shift at any PAGESIZE
+#define SLOTPAGES (CHUNKSIZE / MINPAGESIZE)
+
+// the free page index is a bitmap per chunk with a summary word on top
+// (bit w set if word w has a bit set), and a bitmap of the chunks with
+// free pages with its own summary word above the chunks. Finding a free
+// page is one count trailing zeros per level
+#define LONGBITS (8 * sizeof(unsigned long))
+#define MAPWORDS (SLOTPAGES / LONGBITS)
+#define AVAILWORDS (MAXCHUNKS / LONGBITS)
+
+// what the chunk layer knows about a page (page_state)
+#define PAGE_FRESH 0   // never touched since its chunk was mapped
+#define PAGE_OUT   1   // handed out, in use or cached above the chunks
+#define PAGE_HOT   2   // free and resident, on the LRU
+#define PAGE_COLD  3   // free and given back to the OS
+
+// pages the global free list may hold before they go back to their chunks
+#define DEPOTMAX CHUNKPAGES
+
+// with watermarks, the refill thread trims the global free list back to
+// the high watermark after this long without a refill request
+#define REFILLIDLE 100
+
+// threads that may use the page layer over the lifetime of the process
+#define MAXTHREADS 256
+
+// allocators that may register a shrinker (one per allocator linked in)
+#define MAXSHRINKERS 8
+
+// a file backed pool is mapped at the same address in every process, so
+// that the pointers in it (descriptors, allocator metadata) stay valid.
+// The pool state comes first, rounded up to keep the chunk slots that
+// follow it CHUNKSIZE aligned
+#define POOLADDR 0x600000000000UL
+#define POOLMAGIC 0x314c4f4f50414d4bUL  // "KMAPOOL1"
+#define POOLBUSY 1UL                    // being set up by another process
+#define POOLHDRSIZE \
+  ((sizeof(kma_pool_t) + CHUNKSIZE - 1) & ~(CHUNKSIZE - 1UL))
+#define POOLFILESIZE (POOLHDRSIZE + (unsigned long) MAXCHUNKS * CHUNKSIZE)
+
+typedef struct
+{
+  unsigned long sum;             // bit w set if map[w] is not zero
+  unsigned long map[MAPWORDS];   // one bit per page of the chunk
+} kma_pagemap_t;
+
+typedef struct
+{
+  void* base;                // CHUNKSIZE aligned start, NULL if slot unused
+  kma_pagemap_t free_pages;  // free pages, in any state
+  kma_pagemap_t cold_pages;  // free pages that are fresh or reclaimed
+  int num_free;              // resident, reclaimed and fresh free pages
+  int max_run;               // no run of free pages is longer than this
+  int num_resident;          // pages touched and not given back to the OS
+  int num_reclaimed;         // free pages given back to the OS
+  int backing;               // PAGE_BACKING_* the chunk got from the OS
+  int locked;                // mlocked, see page_config()->lock_pages
+  int node;                  // memory node whose sub-pool it belongs to
+} kma_chunk_t;
+
+// the pages of a pinned chunk cannot be given back to the OS one by one
+#define PINNED(chunk) \
+  ((chunk)->backing == PAGE_BACKING_HUGETLB || (chunk)->locked)
+
+// node of the page with descriptor index i
+#define NODEOF(i) (pool->chunks[(i) / SLOTPAGES].node)
+
+// descriptor index of page i of the span whose first page has index
+// first. A span longer than a chunk goes on in the next slot, whose
+// chunk was mapped right behind
+#define SPANINDEX(first, i) \
+  (((first) / SLOTPAGES \
+    + ((first) % SLOTPAGES + (i)) / CHUNKPAGES) * SLOTPAGES \
+   + ((first) % SLOTPAGES + (i)) % CHUNKPAGES)
+
+// a field of an allocator's page header, see kma_page_layout_t
+#define FIELD(hdr, at, type) (*(type*) ((void*) (hdr) + (at)))
+
+// a node without free pages that may not map another chunk
+#define NODEFULL(n) \
+  (pool->avail_sum[n] == 0 && pool->stats.node_chunks[n] >= nodeLimit())
+
+// only the owning thread writes these, page_snapshot() adds them up
+typedef struct
+{
+  int num_requested;
+  int num_freed;
+  int num_peak;             // of num_requested - num_freed
+  long long stamp;          // op_clock at the last residency update
+  long long page_ops;       // pages in use summed over op_clock up to stamp
+  unsigned int get_latency[PAGE_LATBUCKETS];
+  unsigned int free_latency[PAGE_LATBUCKETS];
+} kma_thread_stat_t;
+
+typedef struct
+{
+  int count;
+  int node;                  // all cached pages belong to this node
+  kma_page_t* pages[MAGSIZE];
+  kma_thread_stat_t* stats;  // NULL until the thread first uses the layer
+} kma_magazine_t;
+
+// everything the chunk layer knows about the pool. A file backed pool
+// keeps it at the start of the file, ahead of the chunk slots, so that
+// the next process finds descriptors, free lists and bitmaps as they were.
+// All links in it are descriptor indices and it is mapped at the same
+// address everywhere, so processes sharing the file can use it at once
+typedef struct
+{
+  unsigned long magic;        // POOLMAGIC once the file holds a pool
+  unsigned long layout;       // sizeof(kma_pool_t), for a changed build
+  int page_size;              // configuration the pool was built with
+  int colors;
+  int clean;                  // detached, no pages lost in thread caches
+  int shared;                 // see share_pool, never detached
+  int nodes;                  // sub-pools, 0 until the first process sets up
+  
+  // protects the chunk layer (chunks, directory, pages_out), process
+  // shared in a file backed or shared pool
+  pthread_mutex_t lock;
+  void* root;                 // the allocator's root at the last detach
+  kma_page_stat_t stats;      // per thread counters are added at detach
+  
+  // chunk slots with at least one free page, per node
+  unsigned long avail_sum[PAGE_MAXNODES];
+  unsigned long avail_map[PAGE_MAXNODES][AVAILWORDS];
+  int num_empty_chunks;
+  
+  // pages currently taken out of the chunks (in use or cached)
+  int pages_out;
+  
+  // global free lists, one per node: Treiber stacks of descriptor
+  // indices. The head packs a modification tag in the upper 32 bits and
+  // index + 1 in the lower 32 bits, so a pop that raced with pop/push of
+  // the same page fails its CAS
+  unsigned long depot_head[PAGE_MAXNODES];
+  int depot_count[PAGE_MAXNODES];
+  
+  // free pages that are still resident, least recently freed first, one
+  // list per node. The chunk layer recycles from the tail (hot pages) and
+  // reclaim works from the head (idle pages). Links are index + 1, stamps
+  // are milliseconds
+  unsigned int lru_head[PAGE_MAXNODES];
+  unsigned int lru_tail[PAGE_MAXNODES];
+  int lru_count[PAGE_MAXNODES];
+  
+  kma_chunk_t chunks[MAXCHUNKS];
+  // one descriptor per pool page, indexed by chunk slot * SLOTPAGES plus
+  // the page number within the chunk
+  kma_page_t page_desc[MAXCHUNKS * SLOTPAGES];
+  unsigned int depot_link[MAXCHUNKS * SLOTPAGES];
+  // PAGE_* state of every page
+  unsigned char page_state[MAXCHUNKS * SLOTPAGES];
+  unsigned int lru_prev[MAXCHUNKS * SLOTPAGES];
+  unsigned int lru_next[MAXCHUNKS * SLOTPAGES];
+  unsigned int lru_stamp[MAXCHUNKS * SLOTPAGES];
+} kma_pool_t;
+
 /************Global Variables*********************************************/
-static kma_page_stat_t kma_page_stats = { 0, 0, 0, PAGESIZE };
+kma_page_config_t kma_page_cfg =
+  { DEFAULTPAGESIZE, FALSE, FALSE, CHUNKSIZE / DEFAULTPAGESIZE, 0, FALSE,
+    FALSE, MAGSIZE / 2, 2 * MAGSIZE, 8 * MAGSIZE, FALSE, FALSE,
+    DEFAULTCOLORS, FALSE, FALSE, FALSE, 0, 0 };
+
+int kma_page_shift = 0;
+
+// the pool state, in the bss unless attach_pool or share_pool maps it
+static kma_pool_t local_pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static kma_pool_t* pool = &local_pool;
+
+
+// chunk slot + 1 for every mapped chunk, 0 if the address is not ours
+static unsigned short* chunk_dir[DIRSIZE];
 
-static void* pool = NULL;
-static void* next_free_page = NULL;
+// where the allocator keeps its root, saved into a file backed pool at exit
+static void** pool_root = NULL;
+// open (and flocked) for as long as a file backed pool is attached
+static int pool_fd = -1;
+// when the pages an attached pool was detached with came back in use
+static long long attach_tick = 0;
+// the residency clock, operations counted with page_tick()
+static long long op_clock = 0;
+
+static __thread kma_magazine_t magazine;
+static kma_thread_stat_t thread_stats[MAXTHREADS];
+static int num_threads = 0;
+static pthread_once_t magazine_once = PTHREAD_ONCE_INIT;
+static pthread_key_t magazine_key;
+
+// memory nodes, fixed when the layer is set up. Fake nodes are spread
+// over the CPUs, or over the threads if there are fewer CPUs than nodes
+static int num_nodes = 1;
+static int fake_nodes = FALSE;
+static int num_cpus = 1;
+
+// background refill of the global free list, see page_config()->watermarks
+static pthread_once_t refiller_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t refill_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t refill_cond = PTHREAD_COND_INITIALIZER;
+static int refill_wanted = 0;
+
+// hooks of the allocators, per process like the functions they point to
+static kma_shrinker_t shrinkers[MAXSHRINKERS];
+static int num_shrinkers = 0;
+// set while this thread runs them, the pages they free must not start
+// another round
+static __thread int shrinking = FALSE;
+// told about every release, see page_waker()
+static kma_waker_t waker = NULL;
 
 /************Function Prototypes******************************************/
-void* allocPage();
-void freePage(void*);
-void initPages();
+kma_page_t* allocPage(int);
+kma_page_t* allocSpan(int, int);
+int findSpan(int, int, kma_chunk_t**);
+int spillNode(int);
+int nodeLimit();
+void countSpill(int, kma_chunk_t*, int);
+kma_page_t* nodePage(int);
+kma_page_t* spillDepot(int);
+kma_page_t* mapView(kma_magazine_t*, int);
+void mapRun(void*, unsigned long, int);
+void unmapView(kma_magazine_t*, kma_page_t*);
+int compareIndex(const void*, const void*);
+void takePage(kma_chunk_t*, unsigned int);
+void freePage(kma_page_t*);
+int findRun(kma_pagemap_t*, int, int*);
+void setBit(unsigned long*, unsigned long[], int);
+void clearBit(unsigned long*, unsigned long[], int);
+int nextBit(unsigned long, unsigned long[], int);
+int nextClear(unsigned long[], int, int);
+int prevClear(unsigned long[], int);
+kma_chunk_t* growPool(int, int);
+void setupChunk(kma_chunk_t*, void*, int, int);
+void fixPageSize();
+int mapPool(char*);
+void initLock();
+void forkChild();
+void* mapChunk(int, int*);
+void prefaultChunk(kma_chunk_t*);
+void bindChunk(kma_chunk_t*);
+void shrinkPool(kma_chunk_t*);
+void dropRange(void*, size_t);
+void registerChunk(kma_chunk_t*);
+kma_chunk_t* findChunk(void*);
+void linkChunk(kma_chunk_t*);
+void unlinkChunk(kma_chunk_t*);
+kma_magazine_t* myMagazine();
+void setupLayer();
+void findNodes();
+int currentNode(kma_magazine_t*);
+void dropMagazine(void*);
+kma_page_t* popPage(kma_magazine_t*, int);
+void pushPage(kma_magazine_t*, kma_page_t*);
+void refillMagazine(kma_magazine_t*, int);
+void flushMagazine(kma_magazine_t*, int);
+void pushPages(kma_page_t*[], int);
+void pushDepot(kma_page_t*[], int);
+kma_page_t* popDepot(int);
+void trimDepot(int, int);
+void checkWatermarks(int);
+void fillDepot(int, int);
+void startRefiller();
+void* refillLoop(void*);
+void wakeRefiller();
+void addStat(int*, int);
+void countPages(kma_thread_stat_t*, int);
+long long opStart();
+void opDone(unsigned int[], long long);
+long long nsNow(clockid_t);
+void lruPush(unsigned int);
+void lruUnlink(unsigned int);
+void reclaimPages(int);
+void reclaimPage(unsigned int);
+unsigned int msNow();
+int runShrinkers(int);
+int drainCaches(kma_magazine_t*, int);
 
 /************External Declaration*****************************************/
 
@@ -85,106 +391,2400 @@ void initPages();
 kma_page_t*
 get_page()
 {
-  static int id = 0;
+  return get_page_node(PAGE_ANYNODE);
+}
+
+kma_page_t*
+get_page_node(int node)
+{
+  kma_magazine_t* mag = myMagazine();
+  long long start = opStart();
   kma_page_t* res;
   
-  kma_page_stats.num_requested++;
-  kma_page_stats.num_in_use++;
+  assert(node < num_nodes);
   
-  res = (kma_page_t*) malloc(sizeof(kma_page_t));
-  res->id = id++;
-  res->size = kma_page_stats.page_size;
-  res->ptr = allocPage();
+  countPages(mag->stats, 1);
+  
+  res = popPage(mag, node);
+  res->size = PAGESIZE;
   
   assert(res->ptr != NULL);
   
+  opDone(mag->stats->get_latency, start);
   return res;	
 }
 
 void
 free_page(kma_page_t* ptr)
 {
+  kma_magazine_t* mag = myMagazine();
+  long long start = opStart();
+  
   assert(ptr != NULL);
   assert(ptr->ptr != NULL);
-  assert(kma_page_stats.num_in_use > 0);
   
-  kma_page_stats.num_freed++;
-  kma_page_stats.num_in_use--;
+  countPages(mag->stats, -1);
   
-  freePage(ptr->ptr);
-  free(ptr);
+  pushPage(mag, ptr);
+  opDone(mag->stats->free_latency, start);
+  
+  if (waker != NULL)
+    {
+      waker();
+    }
 }
 
-kma_page_stat_t*
-page_stats()
+void
+get_pages(int n, kma_page_t* out[])
 {
-  static kma_page_stat_t stats;
+  kma_magazine_t* mag = myMagazine();
+  long long start = opStart();
+  int i;
+  
+  assert(n > 0);
+  
+  countPages(mag->stats, n);
   
-  return memcpy(&stats, &kma_page_stats, sizeof(kma_page_stat_t));
+  for (i = 0; i < n; i++)
+    {
+      out[i] = popPage(mag, PAGE_ANYNODE);
+      out[i]->size = PAGESIZE;
+      
+      assert(out[i]->ptr != NULL);
+    }
+  opDone(mag->stats->get_latency, start);
 }
 
-void*
-allocPage()
+void
+free_pages(kma_page_t* pages[], int n)
 {
-  void* res;
+  kma_magazine_t* mag = myMagazine();
+  long long start = opStart();
+  int i;
+  
+  assert(n >= 0);
+  
+  countPages(mag->stats, -n);
   
-  if (pool == NULL)
+  for (i = 0; i < n; i++)
     {
-      initPages();
+      assert(pages[i] != NULL);
+      assert(pages[i]->ptr != NULL);
+      
+      pushPage(mag, pages[i]);
     }
+  opDone(mag->stats->free_latency, start);
   
-  res = next_free_page;
+  if (waker != NULL && n > 0)
+    {
+      waker();
+    }
+}
+
+void
+free_page_list(void* first, kma_page_link_t next)
+{
+  kma_page_t* batch[PAGEBATCH];
+  int n = 0;
   
-  if (res == NULL)
+  while (first != NULL)
     {
-      error("error: all pages already allocated", "");
+      batch[n++] = next(&first);
+      if (n == PAGEBATCH)
+	{
+	  free_pages(batch, n);
+	  n = 0;
+	}
+    }
+  free_pages(batch, n);
+}
+
+int
+shrink_page_list(kma_page_layout_t* layout, int npages)
+{
+  kma_page_t* batch[PAGEBATCH];
+  void* page;
+  void* next;
+  void** link;
+  int found = 0;
+  int n = 0;
+  int i;
+  
+  // pick the pages first, a count of -1 marks them
+  for (page = layout->pages; page != NULL && found < npages;
+       page = FIELD(page, layout->next_at, void*))
+    {
+      if (FIELD(page, layout->used_at, int) == 0)
+	{
+	  FIELD(page, layout->used_at, int) = -1;
+	  found++;
+	}
+    }
+  if (found == 0)
+    {
+      return 0;
+    }
+  
+  // none of their blocks may stay on a free list
+  for (i = 0; i < layout->nlists; i++)
+    {
+      link = (void**) (layout->lists + i * layout->stride);
+      while (*link != NULL)
+	{
+	  if (FIELD(layout->header(*link), layout->used_at, int) < 0)
+	    *link = *(void**) *link;
+	  else
+	    link = (void**) *link;
+	}
+    }
+  
+  for (page = layout->pages; page != NULL; page = next)
+    {
+      next = FIELD(page, layout->next_at, void*);
+      if (FIELD(page, layout->used_at, int) < 0)
+	{
+	  FIELD(FIELD(page, layout->prev_at, void*), layout->next_at, void*) = next;
+	  if (next != NULL)
+	    FIELD(next, layout->prev_at, void*) = FIELD(page, layout->prev_at, void*);
+	  batch[n++] = *FIELD(page, layout->page_at, kma_page_t**);
+	  if (n == PAGEBATCH)
+	    {
+	      free_pages(batch, n);
+	      n = 0;
+	    }
+	}
+    }
+  free_pages(batch, n);
+  
+  return found;
+}
+
+kma_page_t*
+get_page_span(int npages)
+{
+  kma_magazine_t* mag = myMagazine();
+  long long start = opStart();
+  kma_page_t* res;
+  
+  assert(npages > 0);
+  
+  if (kma_page_cfg.remap_spans)
+    {
+      res = mapView(mag, npages);
+      countPages(mag->stats, npages);
+      res->size = npages * PAGESIZE;
+      opDone(mag->stats->get_latency, start);
+      return res;
     }
   
-  next_free_page = *((void**)next_free_page);
+  pthread_mutex_lock(&pool->lock);
+  while (pool->pages_out + npages > MAXPAGES)
+    {
+      pthread_mutex_unlock(&pool->lock);
+      if (!drainCaches(mag, npages))
+	{
+	  return NULL;
+	}
+      pthread_mutex_lock(&pool->lock);
+    }
+  res = allocSpan(npages, currentNode(mag));
+  pthread_mutex_unlock(&pool->lock);
+  if (res == NULL)
+    {
+      return NULL;
+    }
   
-  assert(res != NULL);
+  countPages(mag->stats, npages);
+  res->size = npages * PAGESIZE;
   
+  opDone(mag->stats->get_latency, start);
   return res;
 }
 
 void
-freePage(void* ptr)
+free_page_span(kma_page_t* span)
 {
-  assert(ptr != NULL);
+  kma_magazine_t* mag = myMagazine();
+  long long start = opStart();
+  int npages = span->size >> kma_page_shift;
+  unsigned int first;
+  int i;
+  
+  assert(span->ptr != NULL);
+  
+  countPages(mag->stats, -npages);
+  
+  if (kma_page_cfg.remap_spans)
+    {
+      unmapView(mag, span);
+    }
+  else
+    {
+      first = span - pool->page_desc;
+      pthread_mutex_lock(&pool->lock);
+      for (i = 0; i < npages; i++)
+	{
+	  freePage(&pool->page_desc[SPANINDEX(first, i)]);
+	}
+      pthread_mutex_unlock(&pool->lock);
+    }
+  opDone(mag->stats->free_latency, start);
+  
+  if (waker != NULL)
+    {
+      waker();
+    }
+}
+
+void*
+get_span_block(int size)
+{
+  kma_page_t* span = get_page_span(SPANPAGES(size));
+  kma_span_hdr_t* hdr;
+  
+  if (span == NULL)
+    {
+      return NULL;
+    }
+  hdr = (kma_span_hdr_t*) span->ptr;
+  hdr->span = span;
+  hdr->npages = SPANPAGES(size);
+  
+  return (void*) hdr + sizeof(kma_span_hdr_t);
+}
+
+void
+free_span_block(void* ptr)
+{
+  free_page_span(((kma_span_hdr_t*) (ptr - sizeof(kma_span_hdr_t)))->span);
+}
+
+kma_page_t*
+find_page(void* ptr)
+{
+  kma_chunk_t* chunk = findChunk(ptr);
   
-  *((void**)ptr) = next_free_page;
-  next_free_page = ptr;
+  if (chunk == NULL)
+    {
+      return NULL;
+    }
   
-  if (kma_page_stats.num_in_use == 0)
+  return &pool->page_desc[(chunk - pool->chunks) * SLOTPAGES
+		    + ((BASEADDR(ptr) - chunk->base) >> kma_page_shift)];
+}
+
+int
+page_headroom(int npages)
+{
+  if (npages > 1 && !kma_page_cfg.remap_spans)
     {
-      free(pool);
-      pool = NULL;
-      next_free_page = NULL;
+      return MAXPAGES - __atomic_load_n(&pool->pages_out, __ATOMIC_RELAXED);
     }
+  
+  return MAXPAGES - page_in_use();
 }
 
 void
-initPages()
+page_shrinker(kma_shrinker_t shrink)
 {
   int i;
   
-  assert(next_free_page == NULL);
-  assert(pool == NULL);
+  pthread_mutex_lock(&pool->lock);
+  for (i = 0; i < num_shrinkers; i++)
+    {
+      if (shrinkers[i] == shrink)
+	break;
+    }
+  if (i == num_shrinkers)
+    {
+      if (num_shrinkers == MAXSHRINKERS)
+	{
+	  pthread_mutex_unlock(&pool->lock);
+	  error("error: too many shrinkers", "");
+	}
+      shrinkers[num_shrinkers++] = shrink;
+    }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void
+page_waker(kma_waker_t wake)
+{
+  waker = wake;
+}
+
+int
+page_reserve(int n)
+{
+  kma_magazine_t* mag = myMagazine();
+  kma_page_t* page;
+  
+  assert(n <= PAGERESERVE && PAGERESERVE <= MAGSIZE / 2);
+  
+  if (mag->count == 0)
+    {
+      mag->node = currentNode(mag);
+    }
+  while (mag->count < n && (page = popDepot(mag->node)) != NULL)
+    {
+      mag->pages[mag->count++] = page;
+    }
+  if (mag->count < n)
+    {
+      pthread_mutex_lock(&pool->lock);
+      while (mag->count < n && pool->pages_out < MAXPAGES)
+	{
+	  mag->pages[mag->count++] = allocPage(mag->node);
+	}
+      pthread_mutex_unlock(&pool->lock);
+    }
+  // the pages the shrinkers free land in this magazine or the depot
+  if (mag->count < n && runShrinkers(n - mag->count) > 0)
+    {
+      return page_reserve(n);
+    }
+  
+  return mag->count >= n;
+}
+
+int
+page_node(kma_page_t* page)
+{
+  return NODEOF(page - pool->page_desc);
+}
+
+kma_page_config_t*
+page_config()
+{
+  return &kma_page_cfg;
+}
+
+kma_page_stat_t*
+page_stats()
+{
+  static kma_page_stat_t stats;
+  
+  page_snapshot(&stats);
+  return &stats;
+}
+
+void
+page_snapshot(kma_page_stat_t* stats)
+{
+  int n = __atomic_load_n(&num_threads, __ATOMIC_ACQUIRE);
+  long long now = __atomic_load_n(&op_clock, __ATOMIC_RELAXED);
+  long long stamp;
+  double page_ops = 0;
+  int base, peaks = 0;
+  int i, b;
   
-  //pool = calloc(MAXPAGES, PAGESIZE);
-  int result = posix_memalign(&pool, PAGESIZE, MAXPAGES * PAGESIZE);
-  if(result)
-    error("Error using posix_memalign to allocate memory", "");
-  next_free_page = pool;
+  memcpy(stats, &pool->stats, sizeof(kma_page_stat_t));
+  stats->page_size = PAGESIZE;
+  if (n > MAXTHREADS)
+    n = MAXTHREADS;
   
-  // use ptr to point to the next free page struct
-  for (i = 0; i < (MAXPAGES - 1); i++)
+  // pages still in use from before attach_pool, nobody's thread counts them
+  base = stats->num_requested - stats->num_freed;
+  if (kma_page_cfg.residency)
     {
-      void* ptr = (pool + i * PAGESIZE);
-      void* next = ptr + PAGESIZE;
+      page_ops += (double) base * (now - attach_tick);
+    }
+  
+  // merge the per thread counters
+  for (i = 0; i < n; i++)
+    {
+      kma_thread_stat_t* st = &thread_stats[i];
+      int requested = __atomic_load_n(&st->num_requested, __ATOMIC_RELAXED);
+      int freed = __atomic_load_n(&st->num_freed, __ATOMIC_RELAXED);
+      
+      stats->num_requested += requested;
+      stats->num_freed += freed;
+      peaks += __atomic_load_n(&st->num_peak, __ATOMIC_RELAXED);
       
-      *((void**) ptr) = next;
+      // the pages the thread holds now count up to the present
+      stamp = __atomic_load_n(&st->stamp, __ATOMIC_RELAXED);
+      page_ops += __atomic_load_n(&st->page_ops, __ATOMIC_RELAXED);
+      page_ops += (double) (requested - freed) * (now - stamp);
+      
+      for (b = 0; b < PAGE_LATBUCKETS; b++)
+	{
+	  stats->get_latency[b] += __atomic_load_n(&st->get_latency[b],
+						   __ATOMIC_RELAXED);
+	  stats->free_latency[b] += __atomic_load_n(&st->free_latency[b],
+						    __ATOMIC_RELAXED);
+	}
+    }
+  stats->num_in_use = stats->num_requested - stats->num_freed;
+  stats->num_nodes = num_nodes;
+  if (base + peaks > stats->num_peak)
+    stats->num_peak = base + peaks;
+  stats->page_ops += page_ops;
+  
+  stats->num_chunks = __atomic_load_n(&pool->stats.num_chunks,
+				      __ATOMIC_RELAXED);
+  stats->num_resident = __atomic_load_n(&pool->stats.num_resident,
+					__ATOMIC_RELAXED);
+  stats->num_reclaimed = __atomic_load_n(&pool->stats.num_reclaimed,
+					 __ATOMIC_RELAXED);
+  stats->num_locked = __atomic_load_n(&pool->stats.num_locked,
+				      __ATOMIC_RELAXED);
+}
+
+int
+page_in_use()
+{
+  int n = __atomic_load_n(&num_threads, __ATOMIC_ACQUIRE);
+  int in_use = pool->stats.num_requested - pool->stats.num_freed;
+  int i;
+  
+  if (n > MAXTHREADS)
+    n = MAXTHREADS;
+  for (i = 0; i < n; i++)
+    {
+      in_use += __atomic_load_n(&thread_stats[i].num_requested,
+				__ATOMIC_RELAXED)
+	- __atomic_load_n(&thread_stats[i].num_freed, __ATOMIC_RELAXED);
+    }
+  
+  return in_use;
+}
+
+void
+page_reset_stats()
+{
+  kma_page_stat_t* stats = &pool->stats;
+  int n = __atomic_load_n(&num_threads, __ATOMIC_ACQUIRE);
+  int i;
+  
+  assert(page_in_use() == 0);
+  
+  pthread_mutex_lock(&pool->lock);
+  stats->num_requested = 0;
+  stats->num_freed = 0;
+  stats->num_peak = 0;
+  stats->num_peak_chunks = stats->num_chunks;
+  stats->num_reclaims = 0;
+  stats->num_releases = 0;
+  stats->num_shrinks = 0;
+  stats->num_shrunk = 0;
+  stats->page_ops = 0;
+  memset(stats->get_latency, 0, sizeof(stats->get_latency));
+  memset(stats->free_latency, 0, sizeof(stats->free_latency));
+  memset(stats->node_spills, 0, sizeof(stats->node_spills));
+  pthread_mutex_unlock(&pool->lock);
+  
+  if (n > MAXTHREADS)
+    n = MAXTHREADS;
+  for (i = 0; i < n; i++)
+    {
+      memset(&thread_stats[i], 0, sizeof(kma_thread_stat_t));
+    }
+  attach_tick = 0;
+}
+
+void
+page_tick()
+{
+  __atomic_store_n(&op_clock, op_clock + 1, __ATOMIC_RELAXED);
+}
+
+int
+attach_pool(char* path, void** root, kma_shrinker_t shrink)
+{
+  int i;
+  
+  if (shrink != NULL)
+    {
+      page_shrinker(shrink);
+    }
+  if (kma_page_shift != 0 || pool_fd >= 0)
+    {
+      error("the pool must be attached before the first page is allocated",
+	    path);
+    }
+  // views live outside the pool mapping and would not survive a restart
+  if (kma_page_cfg.remap_spans)
+    {
+      error("a file backed pool cannot remap spans", path);
+    }
+  
+  pool_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (pool_fd < 0)
+    {
+      error("unable to open the pool file", path);
+    }
+  // a pool belongs to one process at a time
+  if (flock(pool_fd, LOCK_EX | LOCK_NB) != 0)
+    {
+      error("the pool file is in use", path);
     }
   
-  *((void**)(pool + (MAXPAGES - 1) * PAGESIZE)) = NULL;
+  if (!mapPool(path))
+    {
+      pool->clean = FALSE;
+      pool_root = root;
+      atexit(detach_pool);
+      return FALSE;
+    }
+  
+  // pages the last process still held in its thread caches are lost
+  if (pool->shared || !pool->clean)
+    {
+      error("the pool file was not detached", path);
+    }
+  // nobody else has the file, whatever state the lock was left in
+  initLock();
+  // memory locks belong to the process
+  pool->stats.num_locked = 0;
+  for (i = 0; i < MAXCHUNKS; i++)
+    {
+      pool->chunks[i].locked = FALSE;
+    }
+  if (root != NULL)
+    {
+      *root = pool->root;
+    }
+  attach_tick = op_clock;
+  
+  pool->clean = FALSE;
+  pool_root = root;
+  atexit(detach_pool);
+  
+  return TRUE;
+}
+
+int
+share_pool(char* path)
+{
+  char* name = (path != NULL) ? path : "memfd";
+  
+  if (kma_page_shift != 0 || pool_fd >= 0)
+    {
+      error("the pool must be shared before the first page is allocated",
+	    name);
+    }
+  
+  pool_fd = (path != NULL) ? open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)
+    : memfd_create("kma_pool", MFD_CLOEXEC);
+  if (pool_fd < 0)
+    {
+      error("unable to open the shared pool", name);
+    }
+  // keeps attach_pool out while any process shares the pool
+  if (flock(pool_fd, LOCK_SH | LOCK_NB) != 0)
+    {
+      error("the pool file is in use", name);
+    }
+  
+  if (!mapPool(name))
+    {
+      pool->shared = TRUE;
+    }
+  else if (!pool->shared)
+    {
+      error("not a shared pool", name);
+    }
+  
+  // a forked child shares the pool but not the parent's thread caches
+  pthread_atfork(NULL, NULL, forkChild);
+  atexit(detach_pool);
+  
+  return pool_fd;
+}
+
+void
+detach_pool()
+{
+  kma_page_stat_t stats;
+  
+  if (pool_fd < 0 || pool->clean)
+    {
+      return;
+    }
+  
+  // other threads emptied their caches when they exited
+  if (magazine.stats != NULL)
+    {
+      flushMagazine(&magazine, magazine.count);
+    }
+  
+  // the counters of a shared pool stay with each process
+  if (pool->shared)
+    {
+      return;
+    }
+  
+  page_snapshot(&stats);
+  memcpy(&pool->stats, &stats, sizeof(kma_page_stat_t));
+  memset(thread_stats, 0, sizeof(thread_stats));
+  
+  if (pool_root != NULL)
+    {
+      pool->root = *pool_root;
+    }
+  // a restart needs no msync, the page cache outlives the process
+  pool->clean = TRUE;
+}
+
+// single writer counter update that concurrent readers never see torn
+void
+addStat(int* counter, int n)
+{
+  __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+// this thread got (n > 0) or gave back (n < 0) n pages
+void
+countPages(kma_thread_stat_t* st, int n)
+{
+  int in_use = st->num_requested - st->num_freed;
+  long long now;
+  
+  if (kma_page_cfg.residency)
+    {
+      now = __atomic_load_n(&op_clock, __ATOMIC_RELAXED);
+      __atomic_store_n(&st->page_ops,
+		       st->page_ops + in_use * (now - st->stamp),
+		       __ATOMIC_RELAXED);
+      __atomic_store_n(&st->stamp, now, __ATOMIC_RELAXED);
+    }
+  
+  if (n > 0)
+    {
+      addStat(&st->num_requested, n);
+      if (in_use + n > st->num_peak)
+	__atomic_store_n(&st->num_peak, in_use + n, __ATOMIC_RELAXED);
+    }
+  else
+    {
+      addStat(&st->num_freed, -n);
+    }
+}
+
+// start of a page operation, 0 unless page_config()->op_latency
+long long
+opStart()
+{
+  return kma_page_cfg.op_latency ? nsNow(CLOCK_MONOTONIC) : 0;
+}
+
+// counts the operation begun at start into its log2 bucket
+void
+opDone(unsigned int histogram[], long long start)
+{
+  long long ns;
+  int b;
+  
+  if (start == 0)
+    {
+      return;
+    }
+  
+  ns = nsNow(CLOCK_MONOTONIC) - start;
+  b = (ns > 1) ? 63 - __builtin_clzll(ns) : 0;
+  if (b >= PAGE_LATBUCKETS)
+    b = PAGE_LATBUCKETS - 1;
+  __atomic_store_n(&histogram[b], histogram[b] + 1, __ATOMIC_RELAXED);
+}
+
+/***********************************************************************
+ *  Title: Per thread page magazine
+ * ---------------------------------------------------------------------
+ *    Purpose: Returns the calling thread's page cache, registering the
+ *             thread (statistics slot, exit handler) on first use
+ *    Input: none
+ *    Output: the magazine of this thread
+ ***********************************************************************/
+kma_magazine_t*
+myMagazine()
+{
+  int slot;
+  
+  if (magazine.stats != NULL)
+    {
+      return &magazine;
+    }
+  
+  pthread_once(&magazine_once, setupLayer);
+  
+  slot = __atomic_fetch_add(&num_threads, 1, __ATOMIC_ACQ_REL);
+  if (slot >= MAXTHREADS)
+    {
+      error("error: too many threads using the page layer", "");
+    }
+  
+  magazine.count = 0;
+  magazine.node = 0;
+  magazine.stats = &thread_stats[slot];
+  pthread_setspecific(magazine_key, &magazine);
+  
+  return &magazine;
+}
+
+// first use of the page layer in this process
+void
+setupLayer()
+{
+  pthread_key_create(&magazine_key, dropMagazine);
+  
+  // views map pages by their offset in the pool file
+  if (kma_page_cfg.remap_spans && pool_fd < 0)
+    {
+      share_pool(NULL);
+    }
+  
+  findNodes();
+  if (pool->nodes == 0)
+    {
+      pool->nodes = num_nodes;
+    }
+  else if (pool->nodes != num_nodes)
+    {
+      error("the pool was set up with another number of nodes", "");
+    }
+}
+
+// the real NUMA nodes from sysfs, or page_config()->nodes fake ones
+void
+findNodes()
+{
+  DIR* dir;
+  struct dirent* entry;
+  int n = 0;
+  
+  num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+  if (num_cpus < 1)
+    num_cpus = 1;
+  
+  if (kma_page_cfg.nodes > 0)
+    {
+      n = kma_page_cfg.nodes;
+      fake_nodes = TRUE;
+    }
+  else if ((dir = opendir("/sys/devices/system/node")) != NULL)
+    {
+      while ((entry = readdir(dir)) != NULL)
+	{
+	  if (strncmp(entry->d_name, "node", 4) == 0
+	      && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+	    n++;
+	}
+      closedir(dir);
+    }
+  
+  num_nodes = (n < 1) ? 1 : (n > PAGE_MAXNODES) ? PAGE_MAXNODES : n;
+  kma_page_cfg.nodes = num_nodes;
+}
+
+// the node the calling thread runs on
+int
+currentNode(kma_magazine_t* mag)
+{
+  unsigned int cpu, node;
+  
+  if (num_nodes == 1 || getcpu(&cpu, &node) != 0)
+    {
+      return 0;
+    }
+  if (!fake_nodes)
+    {
+      return node % num_nodes;
+    }
+  if (num_cpus < num_nodes)
+    {
+      return (mag->stats - thread_stats) % num_nodes;
+    }
+  
+  return cpu * num_nodes / num_cpus;
+}
+
+// thread exit: whatever the thread still caches goes to the global list
+void
+dropMagazine(void* arg)
+{
+  kma_magazine_t* mag = (kma_magazine_t*) arg;
+  
+  flushMagazine(mag, mag->count);
+}
+
+// a page of the node, PAGE_ANYNODE for whatever the magazine holds
+kma_page_t*
+popPage(kma_magazine_t* mag, int node)
+{
+  if (mag->count > 0 && (node < 0 || node == mag->node))
+    {
+      return mag->pages[--mag->count];
+    }
+  
+  if (mag->count == 0)
+    {
+      refillMagazine(mag, (node < 0) ? currentNode(mag) : node);
+      return mag->pages[--mag->count];
+    }
+  
+  // the magazine caches pages of another node
+  return nodePage(node);
+}
+
+void
+pushPage(kma_magazine_t* mag, kma_page_t* page)
+{
+  // a cached page stays PAGE_OUT, so its size marks it in use instead:
+  // it is 0 from here until the page is handed out again, and a double
+  // free or a free of a page never handed out fails
+  assert(page->size != 0);
+  page->size = 0;
+  
+  // the magazine only caches pages of its node
+  if (num_nodes > 1 && NODEOF(page - pool->page_desc) != mag->node)
+    {
+      pushDepot(&page, 1);
+      return;
+    }
+  
+  if (mag->count == MAGSIZE)
+    {
+      flushMagazine(mag, MAGSIZE / 2);
+    }
+  
+  mag->pages[mag->count++] = page;
+}
+
+// one page of the node, past the magazine
+kma_page_t*
+nodePage(int node)
+{
+  kma_page_t* page = popDepot(node);
+  
+  if (page == NULL && NODEFULL(node))
+    {
+      page = spillDepot(node);
+    }
+  if (page != NULL)
+    {
+      return page;
+    }
+  
+  pthread_mutex_lock(&pool->lock);
+  if (pool->pages_out >= MAXPAGES)
+    {
+      pthread_mutex_unlock(&pool->lock);
+      if (runShrinkers(1) == 0)
+	{
+	  error("error: all pages already allocated", "");
+	}
+      return nodePage(node);
+    }
+  page = allocPage(node);
+  pthread_mutex_unlock(&pool->lock);
+  
+  return page;
+}
+
+/***********************************************************************
+ *  Title: Refills an empty magazine
+ * ---------------------------------------------------------------------
+ *    Purpose: Takes up to half a magazine from the node's global free
+ *             list without locking. Only if that is empty, the chunk
+ *             layer is entered (under the pool lock) for the same
+ *             amount. The magazine belongs to the node from then on
+ *    Input: the empty magazine, the node
+ *    Output: none, the magazine holds at least one page afterwards
+ ***********************************************************************/
+void
+refillMagazine(kma_magazine_t* mag, int node)
+{
+  kma_page_t* page;
+  
+  assert(mag->count == 0);
+  
+  mag->node = node;
+  if (kma_page_cfg.watermarks)
+    {
+      checkWatermarks(node);
+    }
+  
+  while (mag->count < MAGSIZE / 2 && (page = popDepot(node)) != NULL)
+    {
+      mag->pages[mag->count++] = page;
+    }
+  // spilled pages freed on this node went to their own node's list
+  while (mag->count < MAGSIZE / 2 && NODEFULL(node)
+	 && (page = spillDepot(node)) != NULL)
+    {
+      mag->pages[mag->count++] = page;
+    }
+  
+  if (mag->count > 0)
+    {
+      return;
+    }
+  
+  pthread_mutex_lock(&pool->lock);
+  // stay below MAXPAGES even counting what sits in other caches
+  if (pool->pages_out >= MAXPAGES)
+    {
+      pthread_mutex_unlock(&pool->lock);
+      if (runShrinkers(MAGSIZE / 2) == 0)
+	{
+	  error("error: all pages already allocated", "");
+	}
+      // the pages came back through this magazine or the free lists
+      if (mag->count == 0)
+	refillMagazine(mag, node);
+      return;
+    }
+  while (mag->count < MAGSIZE / 2 && pool->pages_out < MAXPAGES)
+    {
+      mag->pages[mag->count++] = allocPage(node);
+    }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// moves the n coldest pages of the magazine to the global free list
+void
+flushMagazine(kma_magazine_t* mag, int n)
+{
+  assert(n <= mag->count);
+  
+  if (n == 0)
+    {
+      return;
+    }
+  
+  pushPages(mag->pages, n);
+  memmove(mag->pages, mag->pages + n, (mag->count - n) * sizeof(kma_page_t*));
+  mag->count -= n;
+  
+  if (!kma_page_cfg.watermarks)
+    {
+      if (__atomic_load_n(&pool->depot_count[mag->node], __ATOMIC_RELAXED)
+	  > DEPOTMAX)
+	{
+	  trimDepot(mag->node, DEPOTMAX / 2);
+	}
+    }
+  else if (__atomic_load_n(&pool->depot_count[mag->node], __ATOMIC_RELAXED)
+	   > kma_page_cfg.wmark_high + DEPOTMAX)
+    {
+      // the refill thread trims when idle, this only bounds the list
+      // while frees keep coming
+      trimDepot(mag->node, kma_page_cfg.wmark_high);
+    }
+}
+
+// pushes pages onto the free lists of their nodes, one CAS per run of
+// pages of the same node (pages spilled from another node make runs)
+void
+pushPages(kma_page_t* pages[], int n)
+{
+  int first = 0;
+  int i;
+  
+  for (i = 1; i <= n; i++)
+    {
+      if (i == n || NODEOF(pages[i] - pool->page_desc)
+	  != NODEOF(pages[first] - pool->page_desc))
+	{
+	  pushDepot(pages + first, i - first);
+	  first = i;
+	}
+    }
+}
+
+// pushes n pages of one node onto its global free list with a single CAS
+void
+pushDepot(kma_page_t* pages[], int n)
+{
+  unsigned long old, new;
+  unsigned int first = pages[0] - pool->page_desc;
+  unsigned int last = pages[n - 1] - pool->page_desc;
+  int node = NODEOF(first);
+  int i;
+  
+  for (i = 0; i < n - 1; i++)
+    {
+      pool->depot_link[pages[i] - pool->page_desc] = (pages[i + 1] - pool->page_desc) + 1;
+    }
+  
+  old = __atomic_load_n(&pool->depot_head[node], __ATOMIC_RELAXED);
+  do
+    {
+      __atomic_store_n(&pool->depot_link[last], (unsigned int) old, __ATOMIC_RELAXED);
+      new = (((old >> 32) + 1) << 32) | (first + 1);
+    }
+  while (!__atomic_compare_exchange_n(&pool->depot_head[node], &old, new, 1,
+				      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  
+  __atomic_fetch_add(&pool->depot_count[node], n, __ATOMIC_RELAXED);
+}
+
+kma_page_t*
+popDepot(int node)
+{
+  unsigned long old, new;
+  unsigned int index, next;
+  
+  old = __atomic_load_n(&pool->depot_head[node], __ATOMIC_ACQUIRE);
+  do
+    {
+      index = (unsigned int) old;
+      if (index == 0)
+	{
+	  return NULL;
+	}
+      // may read a stale link if another thread takes the page first,
+      // but then the tag has moved on and the CAS below fails
+      next = __atomic_load_n(&pool->depot_link[index - 1], __ATOMIC_RELAXED);
+      new = (((old >> 32) + 1) << 32) | next;
+    }
+  while (!__atomic_compare_exchange_n(&pool->depot_head[node], &old, new, 1,
+				      __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+  
+  __atomic_fetch_sub(&pool->depot_count[node], 1, __ATOMIC_RELAXED);
+  
+  return &pool->page_desc[index - 1];
+}
+
+// hands pages from a node's global free list back to their chunks until
+// only target are left, so that fully free chunks can be unmapped again
+void
+trimDepot(int node, int target)
+{
+  kma_page_t* page;
+  
+  pthread_mutex_lock(&pool->lock);
+  while (__atomic_load_n(&pool->depot_count[node], __ATOMIC_RELAXED) > target
+	 && (page = popDepot(node)) != NULL)
+    {
+      freePage(page);
+    }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// asks the allocators for up to npages pages back, returns how many
+// they freed (into this thread's magazine or the global free lists)
+int
+runShrinkers(int npages)
+{
+  int freed = 0;
+  int i;
+  
+  if (shrinking)
+    {
+      return 0;
+    }
+  
+  shrinking = TRUE;
+  for (i = 0; i < num_shrinkers && freed < npages; i++)
+    {
+      freed += shrinkers[i](npages - freed);
+    }
+  shrinking = FALSE;
+  
+  __atomic_add_fetch(&pool->stats.num_shrinks, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&pool->stats.num_shrunk, freed, __ATOMIC_RELAXED);
+  return freed;
+}
+
+// a span needs pages that are back in their chunks, so after the
+// shrinkers the magazine and the global free lists are emptied too.
+// TRUE if that gave back any pages
+int
+drainCaches(kma_magazine_t* mag, int npages)
+{
+  int out = __atomic_load_n(&pool->pages_out, __ATOMIC_RELAXED);
+  int node;
+  
+  runShrinkers(npages);
+  
+  flushMagazine(mag, mag->count);
+  for (node = 0; node < num_nodes; node++)
+    {
+      trimDepot(node, 0);
+    }
+  
+  return __atomic_load_n(&pool->pages_out, __ATOMIC_RELAXED) < out;
+}
+
+/***********************************************************************
+ *  Title: Applies the watermarks before a magazine refill
+ * ---------------------------------------------------------------------
+ *    Purpose: Wakes the refill thread if taking half a magazine leaves
+ *             the node's global free list below the low watermark.
+ *             Below the min watermark the refill thread is evidently
+ *             not keeping up, so the caller fills the list up to low
+ *             itself
+ *    Input: the node
+ *    Output: none
+ ***********************************************************************/
+void
+checkWatermarks(int node)
+{
+  int ready;
+  
+  pthread_once(&refiller_once, startRefiller);
+  
+  ready = __atomic_load_n(&pool->depot_count[node], __ATOMIC_RELAXED)
+    - MAGSIZE / 2;
+  if (ready < kma_page_cfg.wmark_min)
+    {
+      fillDepot(node, kma_page_cfg.wmark_low);
+    }
+  else if (ready < kma_page_cfg.wmark_low)
+    {
+      wakeRefiller();
+    }
+}
+
+/***********************************************************************
+ *  Title: Fills a global free list with ready pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Takes pages out of the chunk layer until the node's free
+ *             list holds target pages (or the pool is exhausted) and
+ *             faults them in, so that the allocation path does not
+ *             take the fault when it first writes to them. Fresh and
+ *             reclaimed pages are zero-filled by the OS, so writing
+ *             zeroes keeps them zeroed
+ *    Input: the node, the number of pages its list should hold
+ *    Output: none
+ ***********************************************************************/
+void
+fillDepot(int node, int target)
+{
+  kma_page_t* pages[PAGEBATCH];
+  long step = sysconf(_SC_PAGESIZE);
+  int n, i;
+  long offset;
+  
+  while ((n = target - __atomic_load_n(&pool->depot_count[node],
+				       __ATOMIC_RELAXED)) > 0)
+    {
+      if (n > PAGEBATCH)
+	n = PAGEBATCH;
+      
+      pthread_mutex_lock(&pool->lock);
+      if (n > MAXPAGES - pool->pages_out)
+	n = MAXPAGES - pool->pages_out;
+      for (i = 0; i < n; i++)
+	{
+	  pages[i] = allocPage(node);
+	}
+      pthread_mutex_unlock(&pool->lock);
+      
+      if (n <= 0)
+	{
+	  return;
+	}
+      
+      // the faults happen outside of the pool lock
+      for (i = 0; i < n; i++)
+	{
+	  for (offset = 0; offset < PAGESIZE; offset += step)
+	    {
+	      ((volatile char*) pages[i]->ptr)[offset] = 0;
+	    }
+	}
+      
+      // spilled pages go to the lists of their own nodes
+      pushPages(pages, n);
+      if (NODEFULL(node))
+	{
+	  return;
+	}
+    }
+}
+
+// starts the refill thread, once per process
+void
+startRefiller()
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+  
+  if (kma_page_cfg.wmark_min < 0
+      || kma_page_cfg.wmark_min > kma_page_cfg.wmark_low
+      || kma_page_cfg.wmark_low > kma_page_cfg.wmark_high)
+    {
+      error("invalid watermarks", "need 0 <= min <= low <= high");
+    }
+  
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, refillLoop, NULL) != 0)
+    {
+      error("unable to start the page refill thread", "");
+    }
+  pthread_attr_destroy(&attr);
+}
+
+/***********************************************************************
+ *  Title: Refill thread
+ * ---------------------------------------------------------------------
+ *    Purpose: Sleeps until an allocation finds a global free list
+ *             below the low watermark and fills every list below low
+ *             up to the high watermark. After REFILLIDLE ms without
+ *             such a request, trims the lists back to the high
+ *             watermark
+ *    Input: unused
+ *    Output: never returns
+ ***********************************************************************/
+void*
+refillLoop(void* arg)
+{
+  struct timespec deadline;
+  int idle, node;
+  
+  for (;;)
+    {
+      pthread_mutex_lock(&refill_lock);
+      idle = FALSE;
+      while (!refill_wanted && !idle)
+	{
+	  clock_gettime(CLOCK_REALTIME, &deadline);
+	  deadline.tv_nsec += REFILLIDLE * 1000000L;
+	  deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+	  deadline.tv_nsec %= 1000000000L;
+	  idle = (pthread_cond_timedwait(&refill_cond, &refill_lock, &deadline)
+		  == ETIMEDOUT);
+	}
+      refill_wanted = FALSE;
+      pthread_mutex_unlock(&refill_lock);
+      
+      for (node = 0; node < num_nodes; node++)
+	{
+	  if (__atomic_load_n(&pool->depot_count[node], __ATOMIC_RELAXED)
+	      < kma_page_cfg.wmark_low)
+	    {
+	      fillDepot(node, kma_page_cfg.wmark_high);
+	    }
+	  else if (idle
+		   && __atomic_load_n(&pool->depot_count[node], __ATOMIC_RELAXED)
+		   > kma_page_cfg.wmark_high)
+	    {
+	      trimDepot(node, kma_page_cfg.wmark_high);
+	    }
+	}
+    }
+  
+  return NULL;
+}
+
+void
+wakeRefiller()
+{
+  // one syscall per refill request, not per allocation
+  if (__atomic_load_n(&refill_wanted, __ATOMIC_RELAXED))
+    {
+      return;
+    }
+  
+  pthread_mutex_lock(&refill_lock);
+  refill_wanted = TRUE;
+  pthread_cond_signal(&refill_cond);
+  pthread_mutex_unlock(&refill_lock);
+}
+
+/***********************************************************************
+ *  Title: Takes one page out of the chunk layer
+ * ---------------------------------------------------------------------
+ *    Purpose: Recycles the node's most recently freed resident page,
+ *             else a reclaimed or fresh page of one of its chunks with
+ *             free pages, growing the node if no chunk has any left.
+ *             With page_config()->address_order set, the lowest free
+ *             page of the node's lowest chunk slot is taken instead,
+ *             which packs the pages in use into as few chunks as
+ *             possible. A full node spills to another one.
+ *             Caller must hold the pool lock
+ *    Input: the node
+ *    Output: the descriptor of the page
+ ***********************************************************************/
+kma_page_t*
+allocPage(int node)
+{
+  int from = (pool->avail_sum[node] != 0) ? node : spillNode(node);
+  kma_chunk_t* chunk;
+  unsigned int index;
+  int slot;
+  
+  if (pool->lru_tail[from] != 0 && !kma_page_cfg.address_order)
+    {
+      index = pool->lru_tail[from] - 1;
+      chunk = &pool->chunks[index / SLOTPAGES];
+    }
+  else
+    {
+      slot = nextBit(pool->avail_sum[from], pool->avail_map[from], 0);
+      chunk = (slot < 0) ? growPool(from, 1) : &pool->chunks[slot];
+      // in LRU order we only get here without resident free pages, so
+      // the lowest free page is a reclaimed or fresh one
+      index = (chunk - pool->chunks) * SLOTPAGES
+	+ nextBit(chunk->free_pages.sum, chunk->free_pages.map, 0);
+    }
+  
+  takePage(chunk, index);
+  pool->pages_out++;
+  countSpill(node, chunk, 1);
+  
+  return &pool->page_desc[index];
+}
+
+/***********************************************************************
+ *  Title: Takes a run of pages out of the chunk layer
+ * ---------------------------------------------------------------------
+ *    Purpose: Finds npages consecutive free pages in the node (first
+ *             fit over its chunks with free pages), growing the node
+ *             if no chunk has such a run. A full node takes the run
+ *             from the nearest node that has one, or that may grow.
+ *             A span of more than CHUNKPAGES gets chunks of its own,
+ *             mapped back to back into consecutive slots.
+ *             Caller must hold the pool lock
+ *    Input: the number of pages and the node
+ *    Output: the descriptor of the first page, NULL if a span longer
+ *            than a chunk finds no run of free slots
+ ***********************************************************************/
+kma_page_t*
+allocSpan(int npages, int node)
+{
+  kma_chunk_t* chunk = NULL;
+  unsigned int index;
+  int first;
+  int d, i;
+  
+  if (npages > CHUNKPAGES)
+    {
+      // whole chunks in a row, mapped in one piece
+      chunk = growPool(spillNode(node), (npages + CHUNKPAGES - 1) / CHUNKPAGES);
+      if (chunk == NULL)
+	{
+	  return NULL;
+	}
+      index = (chunk - pool->chunks) * SLOTPAGES;
+      for (i = 0; i < npages; i++)
+	{
+	  takePage(chunk + i / CHUNKPAGES, SPANINDEX(index, i));
+	}
+      pool->pages_out += npages;
+      countSpill(node, chunk, npages);
+      
+      return &pool->page_desc[index];
+    }
+  
+  first = findSpan(node, npages, &chunk);
+  if (first < 0 && pool->stats.node_chunks[node] >= nodeLimit())
+    {
+      for (d = 1; d < num_nodes && first < 0; d++)
+	{
+	  first = findSpan((node + d) % num_nodes, npages, &chunk);
+	}
+    }
+  if (first < 0)
+    {
+      chunk = growPool(spillNode(node), 1);
+      first = 0;
+    }
+  
+  index = (chunk - pool->chunks) * SLOTPAGES + first;
+  for (i = 0; i < npages; i++)
+    {
+      takePage(chunk, index + i);
+    }
+  pool->pages_out += npages;
+  countSpill(node, chunk, npages);
+  
+  return &pool->page_desc[index];
+}
+
+// first fit of a run of npages over the chunks of a node, -1 if none
+int
+findSpan(int node, int npages, kma_chunk_t** chunk)
+{
+  int first;
+  int slot;
+  
+  for (slot = nextBit(pool->avail_sum[node], pool->avail_map[node], 0);
+       slot >= 0;
+       slot = nextBit(pool->avail_sum[node], pool->avail_map[node], slot + 1))
+    {
+      *chunk = &pool->chunks[slot];
+      if ((*chunk)->max_run >= npages
+	  && (first = findRun(&(*chunk)->free_pages, npages,
+			      &(*chunk)->max_run)) >= 0)
+	{
+	  return first;
+	}
+    }
+  
+  return -1;
+}
+
+// where a node without free pages gets its next pages from: itself if
+// it may map another chunk, else the nearest node that has free pages or
+// may map one. Caller must hold the pool lock
+int
+spillNode(int node)
+{
+  int d, n;
+  
+  if (pool->stats.node_chunks[node] < nodeLimit())
+    {
+      return node;
+    }
+  for (d = 1; d < num_nodes; d++)
+    {
+      n = (node + d) % num_nodes;
+      if (pool->avail_sum[n] != 0)
+	return n;
+    }
+  for (d = 1; d < num_nodes; d++)
+    {
+      n = (node + d) % num_nodes;
+      if (pool->stats.node_chunks[n] < nodeLimit())
+	return n;
+    }
+  
+  // the exit handlers still need the lock
+  pthread_mutex_unlock(&pool->lock);
+  error("error: all pages already allocated", "");
+  return node;
+}
+
+// chunks a node may map
+int
+nodeLimit()
+{
+  return (kma_page_cfg.node_chunks > 0) ? kma_page_cfg.node_chunks
+    : MAXCHUNKS / num_nodes;
+}
+
+// a page from the global free list of the nearest other node, for a
+// full node. NULL if they are all empty
+kma_page_t*
+spillDepot(int node)
+{
+  kma_page_t* page;
+  int d;
+  
+  for (d = 1; d < num_nodes; d++)
+    {
+      page = popDepot((node + d) % num_nodes);
+      if (page != NULL)
+	{
+	  __atomic_add_fetch(&pool->stats.node_spills[node], 1,
+			     __ATOMIC_RELAXED);
+	  return page;
+	}
+    }
+  
+  return NULL;
+}
+
+// counts pages asked for on node that came from another node's chunk
+void
+countSpill(int node, kma_chunk_t* chunk, int npages)
+{
+  if (chunk->node != node)
+    {
+      __atomic_add_fetch(&pool->stats.node_spills[node], npages,
+			 __ATOMIC_RELAXED);
+    }
+}
+
+/***********************************************************************
+ *  Title: Maps scattered pages into one contiguous view
+ * ---------------------------------------------------------------------
+ *    Purpose: Takes npages pages wherever they are free (through the
+ *             thread cache, like get_page) and maps them into a fresh
+ *             range of the address space over their offsets in the
+ *             pool file. They are mapped in file order, so pages that
+ *             follow each other in the file share one mmap. The pages
+ *             are chained through depot_link, which a page does not
+ *             use while it is out
+ *    Input: the magazine of the calling thread, the number of pages
+ *    Output: the descriptor of the first page, ptr set to the view
+ ***********************************************************************/
+kma_page_t*
+mapView(kma_magazine_t* mag, int npages)
+{
+  unsigned int* index = malloc(npages * sizeof(unsigned int));
+  kma_page_t* page;
+  void* view;
+  unsigned long offset, run_offset = 0;
+  int run = 0;
+  int i;
+  
+  assert(index != NULL);
+  for (i = 0; i < npages; i++)
+    {
+      page = popPage(mag, PAGE_ANYNODE);
+      page->size = PAGESIZE;
+      index[i] = page - pool->page_desc;
+    }
+  // descriptor order is file order
+  qsort(index, npages, sizeof(unsigned int), compareIndex);
+  
+  // reserve the whole range, the runs are mapped over it
+  view = mmap(NULL, (size_t) npages << kma_page_shift, PROT_NONE,
+	      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (view == MAP_FAILED)
+    error("Error using mmap to reserve a view", "");
+  
+  for (i = 0; i < npages; i++)
+    {
+      offset = pool->page_desc[index[i]].ptr - (void*) pool;
+      if (run > 0 && offset != run_offset + ((unsigned long) run << kma_page_shift))
+	{
+	  mapRun(view + ((size_t) (i - run) << kma_page_shift), run_offset, run);
+	  run = 0;
+	}
+      if (run++ == 0)
+	run_offset = offset;
+      pool->depot_link[index[i]] = (i + 1 < npages) ? index[i + 1] + 1 : 0;
+    }
+  mapRun(view + ((size_t) (npages - run) << kma_page_shift), run_offset, run);
+  
+  page = &pool->page_desc[index[0]];
+  page->ptr = view;
+  free(index);
+  
+  return page;
+}
+
+// maps npages pages of the pool file at a fixed place of a view
+void
+mapRun(void* at, unsigned long offset, int npages)
+{
+  if (mmap(at, (size_t) npages << kma_page_shift, PROT_READ | PROT_WRITE,
+	   MAP_SHARED | MAP_FIXED, pool_fd, offset) == MAP_FAILED)
+    error("Error using mmap to map a view", "");
+}
+
+// unmaps a view and gives its pages back through the thread cache
+void
+unmapView(kma_magazine_t* mag, kma_page_t* view)
+{
+  unsigned int index = view - pool->page_desc;
+  unsigned int next;
+  
+  munmap(view->ptr, view->size);
+  view->ptr = pool->chunks[index / SLOTPAGES].base
+    + ((index % SLOTPAGES) << kma_page_shift);
+  
+  do
+    {
+      // read the link before the page can reach the depot
+      next = pool->depot_link[index];
+      pushPage(mag, &pool->page_desc[index]);
+      index = next - 1;
+    }
+  while (next != 0);
+}
+
+int
+compareIndex(const void* lhs, const void* rhs)
+{
+  unsigned int a = *(const unsigned int*) lhs;
+  unsigned int b = *(const unsigned int*) rhs;
+  
+  return (a > b) - (a < b);
+}
+
+// moves one free page of the chunk to PAGE_OUT, caller must hold the pool lock
+void
+takePage(kma_chunk_t* chunk, unsigned int index)
+{
+  unsigned int bit = index % SLOTPAGES;
+  
+  switch (pool->page_state[index])
+    {
+    case PAGE_HOT:
+      lruUnlink(index);
+      break;
+    case PAGE_COLD:
+      if (!PINNED(chunk))
+	{
+	  chunk->num_reclaimed--;
+	  __atomic_sub_fetch(&pool->stats.num_reclaimed, 1, __ATOMIC_RELAXED);
+	  chunk->num_resident++;
+	  __atomic_add_fetch(&pool->stats.num_resident, 1, __ATOMIC_RELAXED);
+	}
+      clearBit(&chunk->cold_pages.sum, chunk->cold_pages.map, bit);
+      break;
+    case PAGE_FRESH:
+      chunk->num_resident++;
+      __atomic_add_fetch(&pool->stats.num_resident, 1, __ATOMIC_RELAXED);
+      clearBit(&chunk->cold_pages.sum, chunk->cold_pages.map, bit);
+      break;
+    default:
+      assert(0);
+    }
+  
+  pool->page_state[index] = PAGE_OUT;
+  clearBit(&chunk->free_pages.sum, chunk->free_pages.map, bit);
+  
+  if (chunk->num_free == CHUNKPAGES)
+    {
+      pool->num_empty_chunks--;
+    }
+  
+  if (--chunk->num_free == 0)
+    {
+      unlinkChunk(chunk);
+    }
+  
+  // the descriptor's slot is a unique id, no shared counter to bump
+  pool->page_desc[index].id = index;
+  pool->page_desc[index].ptr = chunk->base + (bit << kma_page_shift);
+}
+
+// gives a page back to its chunk, caller must hold the pool lock
+void
+freePage(kma_page_t* page)
+{
+  unsigned int index = page - pool->page_desc;
+  unsigned int bit = index % SLOTPAGES;
+  // the descriptor index tells us the chunk, no directory lookup needed
+  kma_chunk_t* chunk = &pool->chunks[index / SLOTPAGES];
+  int run;
+  
+  assert(page->ptr != NULL);
+  assert(page->ptr >= chunk->base && page->ptr < chunk->base + CHUNKSIZE);
+  assert(pool->page_state[index] == PAGE_OUT);
+  
+  page->ptr = NULL;
+  pool->pages_out--;
+  pool->page_state[index] = PAGE_HOT;
+  lruPush(index);
+  setBit(&chunk->free_pages.sum, chunk->free_pages.map, bit);
+  if (chunk->max_run < CHUNKPAGES)
+    {
+      // the page may join two runs into one longer than max_run
+      run = nextClear(chunk->free_pages.map, bit, CHUNKPAGES)
+	- prevClear(chunk->free_pages.map, bit) - 1;
+      if (run > chunk->max_run)
+	chunk->max_run = run;
+    }
+  
+  if (chunk->num_free++ == 0)
+    {
+      linkChunk(chunk);
+    }
+  
+  if (chunk->num_free == CHUNKPAGES)
+    {
+      // keep a spare chunk around so that a heap hovering around a chunk
+      // boundary does not map and unmap on every other request
+      if (pool->num_empty_chunks >= KEEPCHUNKS)
+	{
+	  shrinkPool(chunk);
+	  return;
+	}
+      pool->num_empty_chunks++;
+    }
+  
+  if (kma_page_cfg.reclaim)
+    {
+      reclaimPages(chunk->node);
+    }
+}
+
+// start of the lowest run of n free pages in a chunk. Jumps from run to
+// run, so the cost depends on the number of runs, not pages. If there is
+// none, returns -1 and stores the longest run in max_run, so that the
+// chunk is skipped until a free makes a longer run
+int
+findRun(kma_pagemap_t* pages, int n, int* max_run)
+{
+  int start = nextBit(pages->sum, pages->map, 0);
+  int longest = 0;
+  int end;
+  
+  while (start >= 0)
+    {
+      end = nextClear(pages->map, start, CHUNKPAGES);
+      if (end - start >= n)
+	{
+	  return start;
+	}
+      if (end - start > longest)
+	{
+	  longest = end - start;
+	}
+      start = nextBit(pages->sum, pages->map, end);
+    }
+  
+  *max_run = longest;
+  return -1;
+}
+
+// sets a bit of a bitmap below a summary word
+void
+setBit(unsigned long* sum, unsigned long map[], int bit)
+{
+  map[bit / LONGBITS] |= 1UL << (bit % LONGBITS);
+  *sum |= 1UL << (bit / LONGBITS);
+}
+
+void
+clearBit(unsigned long* sum, unsigned long map[], int bit)
+{
+  map[bit / LONGBITS] &= ~(1UL << (bit % LONGBITS));
+  if (map[bit / LONGBITS] == 0)
+    {
+      *sum &= ~(1UL << (bit / LONGBITS));
+    }
+}
+
+// lowest set bit at or above from in a bitmap below a summary word,
+// -1 if there is none
+int
+nextBit(unsigned long sum, unsigned long map[], int from)
+{
+  int word = from / LONGBITS;
+  unsigned long bits;
+  
+  if (word >= LONGBITS)
+    {
+      return -1;
+    }
+  
+  if (sum & (1UL << word))
+    {
+      bits = map[word] & (~0UL << (from % LONGBITS));
+      if (bits != 0)
+	{
+	  return word * LONGBITS + __builtin_ctzl(bits);
+	}
+    }
+  
+  // the summary word points at the next word with a set bit
+  sum = (word + 1 < LONGBITS) ? sum & (~0UL << (word + 1)) : 0;
+  if (sum == 0)
+    {
+      return -1;
+    }
+  word = __builtin_ctzl(sum);
+  
+  return word * LONGBITS + __builtin_ctzl(map[word]);
+}
+
+// highest clear bit below from, -1 if there is none
+int
+prevClear(unsigned long map[], int from)
+{
+  unsigned long bits;
+  
+  for (from--; from >= 0; from = (from / LONGBITS) * LONGBITS - 1)
+    {
+      bits = ~map[from / LONGBITS]
+	& (~0UL >> (LONGBITS - 1 - from % LONGBITS));
+      if (bits != 0)
+	{
+	  return (from / LONGBITS) * LONGBITS + LONGBITS - 1
+	    - __builtin_clzl(bits);
+	}
+    }
+  
+  return -1;
+}
+
+// lowest clear bit at or above from, limit if there is none below it
+int
+nextClear(unsigned long map[], int from, int limit)
+{
+  unsigned long bits;
+  
+  while (from < limit)
+    {
+      bits = ~map[from / LONGBITS] & (~0UL << (from % LONGBITS));
+      if (bits != 0)
+	{
+	  from = (from / LONGBITS) * LONGBITS + __builtin_ctzl(bits);
+	  return (from < limit) ? from : limit;
+	}
+      from = (from / LONGBITS + 1) * LONGBITS;
+    }
+  
+  return limit;
+}
+
+/***********************************************************************
+ *  Title: Gives idle free pages back to the OS
+ * ---------------------------------------------------------------------
+ *    Purpose: Once more than page_config()->reclaim_pages free pages
+ *             are resident, the least recently freed ones are released
+ *             until only half of that is left, so a burst of frees and
+ *             re-allocations does not madvise on every call. With
+ *             reclaim_ms set, pages idle for that long go as well.
+ *             Caller must hold the pool lock
+ *    Input: none
+ *    Output: none
+ ***********************************************************************/
+void
+reclaimPages(int node)
+{
+  unsigned int now;
+  
+  if (pool->lru_count[node] > kma_page_cfg.reclaim_pages)
+    {
+      while (pool->lru_count[node] > kma_page_cfg.reclaim_pages / 2)
+	{
+	  reclaimPage(pool->lru_head[node] - 1);
+	}
+    }
+  
+  if (kma_page_cfg.reclaim_ms > 0 && pool->lru_head[node] != 0)
+    {
+      now = msNow();
+      while (pool->lru_head[node] != 0
+	     && now - pool->lru_stamp[pool->lru_head[node] - 1]
+	     >= kma_page_cfg.reclaim_ms)
+	{
+	  reclaimPage(pool->lru_head[node] - 1);
+	}
+    }
+}
+
+// drops the contents of one resident free page
+void
+reclaimPage(unsigned int index)
+{
+  kma_chunk_t* chunk = &pool->chunks[index / SLOTPAGES];
+  
+  lruUnlink(index);
+  pool->page_state[index] = PAGE_COLD;
+  setBit(&chunk->cold_pages.sum, chunk->cold_pages.map, index % SLOTPAGES);
+  
+  // a piece of a hugetlbfs page cannot be dropped on its own, and
+  // madvise refuses to drop locked pages
+  if (!PINNED(chunk))
+    {
+      dropRange(chunk->base + ((index % SLOTPAGES) << kma_page_shift),
+		PAGESIZE);
+      chunk->num_resident--;
+      __atomic_sub_fetch(&pool->stats.num_resident, 1, __ATOMIC_RELAXED);
+      chunk->num_reclaimed++;
+      __atomic_add_fetch(&pool->stats.num_reclaimed, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&pool->stats.num_reclaims, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// appends a page to the tail of its node's resident free list
+void
+lruPush(unsigned int index)
+{
+  int node = NODEOF(index);
+  
+  pool->lru_prev[index] = pool->lru_tail[node];
+  pool->lru_next[index] = 0;
+  if (pool->lru_tail[node] != 0)
+    pool->lru_next[pool->lru_tail[node] - 1] = index + 1;
+  else
+    pool->lru_head[node] = index + 1;
+  pool->lru_tail[node] = index + 1;
+  pool->lru_stamp[index] = kma_page_cfg.reclaim_ms > 0 ? msNow() : 0;
+  pool->lru_count[node]++;
+}
+
+void
+lruUnlink(unsigned int index)
+{
+  int node = NODEOF(index);
+  
+  assert(pool->page_state[index] == PAGE_HOT);
+  
+  if (pool->lru_prev[index] != 0)
+    pool->lru_next[pool->lru_prev[index] - 1] = pool->lru_next[index];
+  else
+    pool->lru_head[node] = pool->lru_next[index];
+  if (pool->lru_next[index] != 0)
+    pool->lru_prev[pool->lru_next[index] - 1] = pool->lru_prev[index];
+  else
+    pool->lru_tail[node] = pool->lru_prev[index];
+  pool->lru_count[node]--;
+}
+
+// cheap millisecond clock for page idle times
+unsigned int
+msNow()
+{
+  struct timespec ts;
+  
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// nanoseconds for the latencies
+long long
+nsNow(clockid_t clock)
+{
+  struct timespec ts;
+  
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/***********************************************************************
+ *  Title: Maps more chunks into the pool
+ * ---------------------------------------------------------------------
+ *    Purpose: Reserves nchunks * CHUNKSIZE bytes aligned to CHUNKSIZE
+ *             (and thus to PAGESIZE) in consecutive slots, registers
+ *             them in the chunk directory and puts the chunks on the
+ *             node's list of chunks with free pages. Caller must hold
+ *             the pool lock
+ *    Input: the node and the number of chunks
+ *    Output: the first new chunk, NULL if no nchunks slots in a row
+ *            are free (a single chunk is an error instead)
+ ***********************************************************************/
+kma_chunk_t*
+growPool(int node, int nchunks)
+{
+  static int hint = 0;
+  kma_chunk_t* chunk = NULL;
+  void* base;
+  int backing;
+  int i, k, slot = 0;
+  
+  for (i = 0; i < MAXCHUNKS && chunk == NULL; i++)
+    {
+      slot = (hint + i) % MAXCHUNKS;
+      for (k = 0; k < nchunks && slot + k < MAXCHUNKS
+	     && pool->chunks[slot + k].base == NULL; k++)
+	;
+      if (k == nchunks)
+	chunk = &pool->chunks[slot];
+    }
+  if (chunk == NULL)
+    {
+      if (nchunks > 1)
+	return NULL;
+      error("error: all pages already allocated", "");
+    }
+  hint = slot;
+  
+  if (kma_page_shift == 0)
+    {
+      // first chunk, from here on the page size cannot change
+      fixPageSize();
+    }
+  
+  if (pool_fd >= 0)
+    {
+      // the slots of a file backed pool are part of the file mapping
+      base = (void*) pool + POOLHDRSIZE + (unsigned long) slot * CHUNKSIZE;
+      backing = PAGE_BACKING_FILE;
+      pool->stats.backing = PAGE_BACKING_FILE;
+    }
+  else
+    {
+      base = mapChunk(nchunks, &backing);
+    }
+  for (k = 0; k < nchunks; k++)
+    {
+      setupChunk(chunk + k, base + (unsigned long) k * CHUNKSIZE, backing, node);
+    }
+  
+  return chunk;
+}
+
+// puts a freshly mapped chunk into service
+void
+setupChunk(kma_chunk_t* chunk, void* base, int backing, int node)
+{
+  int i;
+  
+  chunk->base = base;
+  chunk->backing = backing;
+  // every page starts out free and fresh
+  memset(&chunk->free_pages, 0, sizeof(kma_pagemap_t));
+  for (i = 0; i < CHUNKPAGES; i++)
+    {
+      setBit(&chunk->free_pages.sum, chunk->free_pages.map, i);
+    }
+  memcpy(&chunk->cold_pages, &chunk->free_pages, sizeof(kma_pagemap_t));
+  chunk->num_free = CHUNKPAGES;
+  chunk->max_run = CHUNKPAGES;
+  chunk->num_resident = 0;
+  chunk->num_reclaimed = 0;
+  chunk->locked = FALSE;
+  chunk->node = node;
+  // the policy has to be in place before the first fault
+  if (!fake_nodes && num_nodes > 1)
+    {
+      bindChunk(chunk);
+    }
+  if (kma_page_cfg.prefault || kma_page_cfg.lock_pages)
+    {
+      prefaultChunk(chunk);
+    }
+  
+  if (pool_fd < 0)
+    {
+      registerChunk(chunk);
+    }
+  
+  pool->num_empty_chunks++;
+  if (__atomic_add_fetch(&pool->stats.num_chunks, 1, __ATOMIC_RELAXED)
+      > pool->stats.num_peak_chunks)
+    {
+      pool->stats.num_peak_chunks = pool->stats.num_chunks;
+    }
+  __atomic_add_fetch(&pool->stats.node_chunks[node], 1, __ATOMIC_RELAXED);
+  linkChunk(chunk);
+}
+
+// checks the page size and colors and derives kma_page_shift
+void
+fixPageSize()
+{
+  if (PAGESIZE < MINPAGESIZE || PAGESIZE > MAXPAGESIZE
+      || (PAGESIZE & (PAGESIZE - 1)) != 0)
+    error("invalid page size", "not a power of two in [4096, 65536]");
+  if (kma_page_cfg.colors < 1 || kma_page_cfg.colors > MAXCOLORS
+      || (kma_page_cfg.colors & (kma_page_cfg.colors - 1)) != 0)
+    error("invalid number of page colors", "not a power of two in [1, 16]");
+  kma_page_shift = ffs(PAGESIZE) - 1;
+}
+
+/***********************************************************************
+ *  Title: Maps a pool file
+ * ---------------------------------------------------------------------
+ *    Purpose: Maps the open pool file (pool_fd) at POOLADDR and makes
+ *             it the pool. An empty file is sized and set up as a new
+ *             pool with the current configuration. Otherwise the pool
+ *             in it is checked and its page size and colors are taken
+ *             over. When processes share a file, the first one to
+ *             claim the magic word sets it up and the others wait
+ *    Input: the name of the file, for errors
+ *    Output: TRUE if the file already held a pool
+ ***********************************************************************/
+int
+mapPool(char* name)
+{
+  unsigned long magic = 0;
+  kma_pool_t* mapped;
+  struct stat st;
+  
+  if (fstat(pool_fd, &st) != 0
+      || (st.st_size != 0 && st.st_size != POOLFILESIZE))
+    {
+      error("not a pool file", name);
+    }
+  // sparse, only the pool state and the chunks in use take up space
+  if (st.st_size == 0 && ftruncate(pool_fd, POOLFILESIZE) != 0)
+    {
+      error("unable to size the pool file", name);
+    }
+  
+  mapped = mmap((void*) POOLADDR, POOLFILESIZE, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_FIXED_NOREPLACE, pool_fd, 0);
+  if (mapped != (void*) POOLADDR)
+    {
+      error("unable to map the pool file at its fixed address", name);
+    }
+  pool = mapped;
+  
+  if (__atomic_compare_exchange_n(&pool->magic, &magic, POOLBUSY, 0,
+				  __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+    {
+      fixPageSize();
+      pool->layout = sizeof(kma_pool_t);
+      pool->page_size = PAGESIZE;
+      pool->colors = kma_page_cfg.colors;
+      initLock();
+      __atomic_store_n(&pool->magic, POOLMAGIC, __ATOMIC_RELEASE);
+      return FALSE;
+    }
+  
+  while (magic == POOLBUSY)
+    {
+      sched_yield();
+      magic = __atomic_load_n(&pool->magic, __ATOMIC_ACQUIRE);
+    }
+  if (magic != POOLMAGIC || pool->layout != sizeof(kma_pool_t))
+    {
+      error("not a pool file of this build", name);
+    }
+  kma_page_cfg.page_size = pool->page_size;
+  kma_page_cfg.colors = pool->colors;
+  fixPageSize();
+  
+  return TRUE;
+}
+
+// the lock of a mapped pool works across processes
+void
+initLock()
+{
+  pthread_mutexattr_t attr;
+  
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutex_init(&pool->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+// fork handler of a shared pool: the pages in the thread cache the child
+// copied stay with the parent, and the child counts from zero
+void
+forkChild()
+{
+  static const pthread_once_t once = PTHREAD_ONCE_INIT;
+  
+  magazine.count = 0;
+  memset(thread_stats, 0, sizeof(thread_stats));
+  // the refill thread, if any, was not forked along
+  memcpy(&refiller_once, &once, sizeof(pthread_once_t));
+}
+
+/***********************************************************************
+ *  Title: Maps the memory of one chunk
+ * ---------------------------------------------------------------------
+ *    Purpose: Gets nchunks * CHUNKSIZE bytes aligned to CHUNKSIZE
+ *             from the OS.
+ *             With page_config()->hugepages set, hugetlbfs pages are
+ *             tried first, then transparent huge pages via madvise,
+ *             and plain base pages if neither is available
+ *    Input: the number of chunks and where to store the
+ *           PAGE_BACKING_* actually used
+ *    Output: the start of the first chunk
+ ***********************************************************************/
+void*
+mapChunk(int nchunks, int* backing)
+{
+  size_t length = (size_t) nchunks * CHUNKSIZE;
+  void* region;
+  size_t head;
+  
+  if (kma_page_cfg.hugepages)
+    {
+      // CHUNKSIZE is the x86 huge page size, so one huge page per chunk.
+      // No MAP_NORESERVE: without reserved huge pages the mmap has to
+      // fail here rather than SIGBUS on first touch
+      region = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB
+		    | (kma_page_cfg.prefault ? MAP_POPULATE : 0), -1, 0);
+      if (region != MAP_FAILED)
+	{
+	  assert(((unsigned long) region & (CHUNKSIZE - 1)) == 0);
+	  *backing = PAGE_BACKING_HUGETLB;
+	  pool->stats.backing = *backing;
+	  return region;
+	}
+    }
+  
+  // reserve without committing swap or touching it; pages only become
+  // resident when an allocator first writes to them
+  region = mmap(NULL, length + CHUNKSIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (region == MAP_FAILED)
+    error("Error using mmap to reserve a pool chunk", "");
+  
+  // trim the mapping down to CHUNKSIZE aligned chunks
+  head = (CHUNKSIZE - ((unsigned long) region & (CHUNKSIZE - 1))) & (CHUNKSIZE - 1);
+  if (head > 0)
+    munmap(region, head);
+  munmap(region + head + length, CHUNKSIZE - head);
+  region += head;
+  
+  *backing = PAGE_BACKING_BASE;
+  if (kma_page_cfg.hugepages && madvise(region, length, MADV_HUGEPAGE) == 0)
+    {
+      *backing = PAGE_BACKING_THP;
+    }
+  pool->stats.backing = *backing;
+  
+  return region;
+}
+
+// gives the memory behind a range of a chunk back, it reads as zeroes
+// afterwards. Dropping the mapping of a file page would leave it in the
+// file, so a file backed pool punches a hole instead
+void
+dropRange(void* start, size_t length)
+{
+  madvise(start, length, pool_fd >= 0 ? MADV_REMOVE : MADV_DONTNEED);
+}
+
+// asks the kernel to back the chunk with memory of its node. Preferred
+// rather than bound, so that a node out of memory falls back like a
+// spill does. Hugetlbfs chunks are populated by mmap and stay put
+void
+bindChunk(kma_chunk_t* chunk)
+{
+  unsigned long mask = 1UL << chunk->node;
+  
+  syscall(SYS_mbind, chunk->base, CHUNKSIZE, MPOL_PREFERRED, &mask,
+	  PAGE_MAXNODES + 1, 0);
+}
+
+/***********************************************************************
+ *  Title: Faults in a new chunk
+ * ---------------------------------------------------------------------
+ *    Purpose: Makes every page of the chunk resident (hugetlbfs chunks
+ *             are populated by mmap already) and, with
+ *             page_config()->lock_pages, locks the chunk in memory if
+ *             RLIMIT_MEMLOCK allows. The pages then start out resident
+ *             free pages on the LRU, lowest page at the tail.
+ *             Caller must hold the pool lock
+ *    Input: the chunk, just mapped
+ *    Output: none
+ ***********************************************************************/
+void
+prefaultChunk(kma_chunk_t* chunk)
+{
+  unsigned int first = (chunk - pool->chunks) * SLOTPAGES;
+  long step = sysconf(_SC_PAGESIZE);
+  long offset;
+  int i;
+  
+  // not MAP_POPULATE for base pages: mapChunk over-reserves and trims,
+  // and populating the trimmed half would be wasted work
+  if (chunk->backing != PAGE_BACKING_HUGETLB
+      && madvise(chunk->base, CHUNKSIZE, MADV_POPULATE_WRITE) != 0)
+    {
+      // kernels before 5.14 do not know MADV_POPULATE_WRITE
+      for (offset = 0; offset < CHUNKSIZE; offset += step)
+	{
+	  ((volatile char*) chunk->base)[offset] = 0;
+	}
+    }
+  
+  if (kma_page_cfg.lock_pages && mlock(chunk->base, CHUNKSIZE) == 0)
+    {
+      chunk->locked = TRUE;
+      __atomic_add_fetch(&pool->stats.num_locked, CHUNKPAGES,
+			 __ATOMIC_RELAXED);
+    }
+  
+  for (i = CHUNKPAGES - 1; i >= 0; i--)
+    {
+      pool->page_state[first + i] = PAGE_HOT;
+      lruPush(first + i);
+      clearBit(&chunk->cold_pages.sum, chunk->cold_pages.map, i);
+    }
+  chunk->num_resident = CHUNKPAGES;
+  __atomic_add_fetch(&pool->stats.num_resident, CHUNKPAGES,
+		     __ATOMIC_RELAXED);
+}
+
+/***********************************************************************
+ *  Title: Unmaps a completely free chunk
+ * ---------------------------------------------------------------------
+ *    Purpose: Returns the chunk to the OS and drops it from the
+ *             chunk directory
+ *    Input: the chunk, all of its pages must be free
+ *    Output: none
+ ***********************************************************************/
+void
+shrinkPool(kma_chunk_t* chunk)
+{
+  unsigned long key = (unsigned long) chunk->base >> CHUNKSHIFT;
+  unsigned int first = (chunk - pool->chunks) * SLOTPAGES;
+  unsigned int index;
+  
+  assert(chunk->num_free == CHUNKPAGES);
+  
+  for (index = first; index < first + CHUNKPAGES; index++)
+    {
+      if (pool->page_state[index] == PAGE_HOT)
+	lruUnlink(index);
+      pool->page_state[index] = PAGE_FRESH;
+    }
+  __atomic_sub_fetch(&pool->stats.num_resident, chunk->num_resident,
+		     __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&pool->stats.num_reclaimed, chunk->num_reclaimed,
+		     __ATOMIC_RELAXED);
+  if (chunk->locked)
+    {
+      // munmap unlocks
+      __atomic_sub_fetch(&pool->stats.num_locked, CHUNKPAGES,
+			 __ATOMIC_RELAXED);
+    }
+  
+  unlinkChunk(chunk);
+  if (pool_fd >= 0)
+    {
+      // the slot stays mapped, only the file space goes
+      if (chunk->locked)
+	munlock(chunk->base, CHUNKSIZE);
+      dropRange(chunk->base, CHUNKSIZE);
+    }
+  else
+    {
+      chunk_dir[key >> DIRBITS][key & (DIRSIZE - 1)] = 0;
+      munmap(chunk->base, CHUNKSIZE);
+    }
+  
+  chunk->base = NULL;
+  chunk->num_free = 0;
+  chunk->num_resident = 0;
+  chunk->num_reclaimed = 0;
+  __atomic_sub_fetch(&pool->stats.num_chunks, 1, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&pool->stats.node_chunks[chunk->node], 1,
+		     __ATOMIC_RELAXED);
+  __atomic_add_fetch(&pool->stats.num_releases, 1, __ATOMIC_RELAXED);
+}
+
+// enters a mapped chunk into the chunk directory
+void
+registerChunk(kma_chunk_t* chunk)
+{
+  unsigned long key = (unsigned long) chunk->base >> CHUNKSHIFT;
+  void* leaf;
+  
+  assert((key >> DIRBITS) < DIRSIZE);
+  if (chunk_dir[key >> DIRBITS] == NULL)
+    {
+      leaf = mmap(NULL, DIRSIZE * sizeof(unsigned short),
+		  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (leaf == MAP_FAILED)
+	error("Error using mmap to extend the chunk directory", "");
+      chunk_dir[key >> DIRBITS] = leaf;
+    }
+  chunk_dir[key >> DIRBITS][key & (DIRSIZE - 1)] = chunk - pool->chunks + 1;
+}
+
+// O(1) lookup of the chunk that contains a page address
+kma_chunk_t*
+findChunk(void* ptr)
+{
+  unsigned long key = (unsigned long) ptr >> CHUNKSHIFT;
+  unsigned short* leaf = chunk_dir[(key >> DIRBITS) & (DIRSIZE - 1)];
+  unsigned long offset;
+  
+  if (pool_fd >= 0)
+    {
+      // the slots of a file backed pool have fixed places, which also
+      // covers chunks that another process mapped
+      offset = (unsigned long) ptr - ((unsigned long) pool + POOLHDRSIZE);
+      if (offset >= (unsigned long) MAXCHUNKS * CHUNKSIZE
+	  || pool->chunks[offset >> CHUNKSHIFT].base == NULL)
+	{
+	  return NULL;
+	}
+      return &pool->chunks[offset >> CHUNKSHIFT];
+    }
+  
+  if (leaf == NULL || leaf[key & (DIRSIZE - 1)] == 0)
+    {
+      return NULL;
+    }
+  
+  return &pool->chunks[leaf[key & (DIRSIZE - 1)] - 1];
+}
+
+// marks a chunk as having free pages
+void
+linkChunk(kma_chunk_t* chunk)
+{
+  setBit(&pool->avail_sum[chunk->node], pool->avail_map[chunk->node],
+	 chunk - pool->chunks);
+}
+
+void
+unlinkChunk(kma_chunk_t* chunk)
+{
+  clearBit(&pool->avail_sum[chunk->node], pool->avail_map[chunk->node],
+	   chunk - pool->chunks);
 }
@@ -71,9 +71,36 @@
 #define EXTERN extern
 #endif
 
-#define PAGESIZE 8192
+/* the page size is a power of two in [MINPAGESIZE, MAXPAGESIZE], chosen
+ * through page_config() before the first page is allocated */
+#define MINPAGESIZE 4096
+#define MAXPAGESIZE 65536
+#define DEFAULTPAGESIZE 8192
+#define PAGESIZE (kma_page_cfg.page_size)
 
-#define MAXPAGES 4096
+/* the pool grows and shrinks in CHUNKSIZE steps, up to MAXCHUNKS chunks.
+ * The pool state holds the descriptors of every chunk slot, about 21 KB
+ * of bss per chunk, so raise it (-DMAXCHUNKS) only for larger pools */
+#define CHUNKSHIFT 21
+#define CHUNKSIZE (1 << CHUNKSHIFT)
+#define CHUNKPAGES (CHUNKSIZE / PAGESIZE)
+#ifndef MAXCHUNKS
+#define MAXCHUNKS 256
+#endif
+
+/* suggested number of pages to hand to get_pages/free_pages at once */
+#define PAGEBATCH 64
+
+/* most pages page_reserve() can hold for a thread */
+#define PAGERESERVE 16
+
+/* the pool keeps one sub-pool per memory node, see get_page_node() */
+#define PAGE_MAXNODES 8
+#define PAGE_ANYNODE (-1)
+
+#ifndef MAXPAGES
+#define MAXPAGES (MAXCHUNKS * CHUNKPAGES)
+#endif
 
 /***********************************************************************
  *  Title: Base Address Macro
@@ -85,6 +112,41 @@
  ***********************************************************************/
 #define BASEADDR(x) ((void*)(((long) (x)) & ~(PAGESIZE-1)))
 
+/* allocators that keep a header in every page put it at PAGECOLOR(page)
+ * times a stride of their own from the page start, so that the headers
+ * of neighbouring pages do not all map to the same cache sets */
+#define DEFAULTCOLORS 8
+#define MAXCOLORS 16
+#define CACHELINE 64
+
+/***********************************************************************
+ *  Title: Page Color Macro
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the color of the page a pointer points into
+ *    Input: pointer
+ *    Output: the color, in [0, page_config()->colors)
+ ***********************************************************************/
+#define PAGECOLOR(x) \
+  ((((unsigned long) (x)) >> kma_page_shift) & (kma_page_cfg.colors - 1))
+
+/* offset of the header of a page whose allocator steps stride bytes
+ * per color */
+#define HDROFFSET(page, stride) (PAGECOLOR(page) * (stride))
+
+/* requests that do not fit behind the back pointer and a hdrsize byte
+ * header get a page of their own. kma_free only has the size to tell
+ * such a page from a shared one, and a freed block may be handed to a
+ * request on a page of another color, so the check reserves the worst
+ * color, (colors - 1) strides. A request that would fit at its page's
+ * color thus gets a private page too: it takes a whole page either way
+ * (it is over half a page), so at most the space in front of the
+ * header is lost. With 4 KB pages, 959 requests of testsuite/4.trace
+ * are affected in p2fl, and the trace peaks 14 pages (0.5%) above -C 1
+ * with all costs of coloring counted, see bench-coloring */
+#define OWN_PAGE(size, stride, hdrsize) \
+  ((size) + (kma_page_cfg.colors - 1) * (stride) \
+   + sizeof(kma_page_t*) + (hdrsize) > PAGESIZE)
+
 typedef struct
 {
   int id;
@@ -92,16 +154,124 @@ typedef struct
   int size;
 } kma_page_t;
 
+/* what allocators put in front of a large request served from a span */
+typedef struct
+{
+  kma_page_t* span;  /* for free_page_span, span->size is its length */
+  int npages;
+} kma_span_hdr_t;
+
+/* pages of a span holding size bytes behind a kma_span_hdr_t */
+#define SPANPAGES(size) \
+  (((size) + sizeof(kma_span_hdr_t) + PAGESIZE - 1) / PAGESIZE)
+
+/* where the pool memory comes from, see kma_page_stat_t.backing */
+#define PAGE_BACKING_BASE    0  /* base (4 KB) pages */
+#define PAGE_BACKING_HUGETLB 1  /* reserved hugetlbfs pages (MAP_HUGETLB) */
+#define PAGE_BACKING_THP     2  /* transparent huge pages (MADV_HUGEPAGE) */
+#define PAGE_BACKING_FILE    3  /* the pool file, see attach_pool() */
+
+typedef struct
+{
+  int page_size;      /* PAGESIZE, fixed once the pool is set up */
+  int hugepages;      /* back pool chunks with 2 MB huge pages if possible */
+  int reclaim;        /* give idle free pages back to the OS */
+  int reclaim_pages;  /* resident free pages kept before reclaiming */
+  int reclaim_ms;     /* also reclaim pages free this long, 0 for never */
+  int address_order;  /* hand out the lowest free page of the pool rather
+                         than the most recently freed one */
+  int watermarks;     /* keep faulted-in free pages ready in a background
+                         thread, between the watermarks below */
+  int wmark_min;      /* below this the allocating thread refills itself */
+  int wmark_low;      /* below this the background thread is woken */
+  int wmark_high;     /* it refills up to this and trims back to it */
+  int prefault;       /* fault in every chunk when it is mapped */
+  int lock_pages;     /* prefault and mlock every chunk */
+  int colors;         /* page header colors, a power of two, 1 for none */
+  int remap_spans;    /* map spans from scattered pages into a fresh range
+                         (puts the pool in a memfd, see get_page_span) */
+  int residency;      /* sum the pages in use over the operations the
+                         caller counts with page_tick() */
+  int op_latency;     /* time every page operation into the latency
+                         histograms, two clock reads per operation */
+  int nodes;          /* 0 for the machine's NUMA nodes, else fake this
+                         many nodes over the CPUs (or threads) */
+  int node_chunks;    /* chunks a node may map before its requests spill
+                         to other nodes, 0 for an equal share */
+} kma_page_config_t;
+
+/* log2 buckets of the latency histograms: bucket b counts operations
+   that took 2^b to 2^(b+1) - 1 ns, the last one everything slower */
+#define PAGE_LATBUCKETS 24
+
 typedef struct
 {
   int num_requested;
   int num_freed;
   int num_in_use;
   int page_size;
+  int num_chunks;
+  int backing;     /* PAGE_BACKING_* of the most recently mapped chunk */
+  int num_resident;  /* pool pages backed by memory, in use or free */
+  int num_reclaimed; /* free pool pages given back to the OS */
+  int num_locked;    /* pool pages locked in memory */
+  int num_peak;      /* most pages in use at once. With several threads
+                        the sum of their own peaks, an upper bound */
+  int num_peak_chunks;
+  int num_reclaims;  /* pages given back to the OS so far */
+  int num_releases;  /* chunks given back to the OS so far */
+  int num_shrinks;   /* times the pool ran out and the shrinkers ran */
+  int num_shrunk;    /* pages the shrinkers gave back */
+  double page_ops;   /* pages in use summed over page_tick(), needs
+                        page_config()->residency */
+  /* get_page/get_pages/get_page_span and the matching frees, one sample
+     per call, needs page_config()->op_latency */
+  unsigned int get_latency[PAGE_LATBUCKETS];
+  unsigned int free_latency[PAGE_LATBUCKETS];
+  int num_nodes;
+  int node_chunks[PAGE_MAXNODES];
+  int node_spills[PAGE_MAXNODES]; /* pages asked for on the node but
+                                     taken from another one */
 } kma_page_stat_t;
 
+/* gives back up to npages fully free pages the allocator still holds,
+   see page_shrinker() */
+typedef int (*kma_shrinker_t)(int npages);
+
+/* told that pages went back to the pool, see page_waker() */
+typedef void (*kma_waker_t)(void);
+
+/* returns the page of the header at *cursor and moves *cursor on to the
+   next header of the allocator's chain of pages, NULL after the last
+   one. See free_page_list() */
+typedef kma_page_t* (*kma_page_link_t)(void** cursor);
+
+/* how an allocator keeps its pages and free lists, for shrink_page_list().
+   The pages are a doubly linked chain of headers, each with a count of
+   blocks in use. The free lists are heads stride bytes apart, each
+   starting a chain of free blocks linked through their first word */
+typedef struct
+{
+  void* pages;        /* first header the shrinker may give back, its
+                         prev link must not be NULL */
+  size_t next_at;     /* offsets of the header fields: next header, */
+  size_t prev_at;     /* previous header, */
+  size_t used_at;     /* int count of blocks in use, */
+  size_t page_at;     /* pointer to where the kma_page_t* is kept */
+  void* lists;        /* the first free list head */
+  int nlists;
+  size_t stride;
+  void* (*header)(void* block); /* header of the page of a block */
+} kma_page_layout_t;
+
 /************Global Variables*********************************************/
 
+/* use page_config() to change it, PAGESIZE reads it directly */
+EXTERN kma_page_config_t kma_page_cfg;
+
+/* log2(PAGESIZE), set when the first pool chunk is mapped */
+EXTERN int kma_page_shift;
+
 /************Function Prototypes******************************************/
 
 /***********************************************************************
@@ -113,6 +283,83 @@ typedef struct
  ***********************************************************************/
 EXTERN kma_page_t* get_page();
 
+/***********************************************************************
+ *  Title: Allocates a memory page on a memory node
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates a memory page from the sub-pool of a node. Only
+ *             if the node has no free page and may not map another
+ *             chunk (page_config()->node_chunks), the page comes from
+ *             the nearest node that has one. get_page() asks for the
+ *             node the calling thread runs on
+ *    Input: the node, or PAGE_ANYNODE for the current one
+ *    Output: the allocated memory page
+ ***********************************************************************/
+EXTERN kma_page_t* get_page_node(int node);
+
+/***********************************************************************
+ *  Title: Pages left in the pool
+ * ---------------------------------------------------------------------
+ *    Purpose: Get how many more pages can be allocated before the pool
+ *             is exhausted (MAXPAGES). Free pages cached by the page
+ *             layer count as available for single pages, but not for
+ *             spans, which need pages that are still in their chunks
+ *    Input: 1 for single pages, more for a span of that many pages
+ *    Output: the number of pages, may be negative
+ ***********************************************************************/
+EXTERN int page_headroom(int npages);
+
+/***********************************************************************
+ *  Title: Registers a shrinker
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocators that keep free pages on their own lists
+ *             register a hook here. When the pool is exhausted, the
+ *             page layer calls the hooks, which free_page what they
+ *             can spare, and retries before giving up. A hook runs
+ *             inside the get_page call of the allocator that ran out,
+ *             so it must leave the allocator's lists consistent for
+ *             that call. Registering a hook again has no effect
+ *    Input: the hook
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_shrinker(kma_shrinker_t);
+
+/***********************************************************************
+ *  Title: Registers a waker
+ * ---------------------------------------------------------------------
+ *    Purpose: The page layer calls the hook at the end of every
+ *             free_page, free_pages and free_page_span, outside the
+ *             pool lock, whoever released the pages: an allocator's
+ *             kma_free, its shrinker or its reset. The allocator may
+ *             be in the middle of an operation then, so the hook must
+ *             not call into it. One hook, NULL removes it
+ *    Input: the hook
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_waker(kma_waker_t);
+
+/***********************************************************************
+ *  Title: Reserves pages for the next get_page calls
+ * ---------------------------------------------------------------------
+ *    Purpose: Fills the calling thread's cache up to n pages, running
+ *             the shrinkers if the pool is short, so that the next n
+ *             get_page (or get_pages) calls of the thread are served
+ *             from it and cannot run out. Since the shrinkers call
+ *             into the allocators, not for use inside one. Whatever
+ *             was taken stays cached if n cannot be reached
+ *    Input: the number of pages, at most PAGERESERVE
+ *    Output: TRUE if n pages are reserved
+ ***********************************************************************/
+EXTERN int page_reserve(int n);
+
+/***********************************************************************
+ *  Title: Node of a memory page
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the memory node a page belongs to
+ *    Input: the page
+ *    Output: the node
+ ***********************************************************************/
+EXTERN int page_node(kma_page_t*);
+
 /***********************************************************************
  *  Title: Releases a memory page 
  * ---------------------------------------------------------------------
@@ -122,6 +369,169 @@ EXTERN kma_page_t* get_page();
  ***********************************************************************/
 EXTERN void free_page(kma_page_t*);
 
+/***********************************************************************
+ *  Title: Allocates several memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates n memory pages with a single statistics update
+ *    Input: the number of pages and an array with room for them
+ *    Output: the allocated memory pages, stored in the array
+ ***********************************************************************/
+EXTERN void get_pages(int n, kma_page_t* out[]);
+
+/***********************************************************************
+ *  Title: Releases several memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases n memory pages with a single statistics update
+ *    Input: an array of memory page structures and its length
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_pages(kma_page_t* pages[], int n);
+
+/***********************************************************************
+ *  Title: Releases a chain of memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Walks an allocator's chain of page headers and releases
+ *             the pages PAGEBATCH at a time through free_pages. The
+ *             walker reads the link before the page is released
+ *    Input: the first header (NULL for none) and the walker
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_page_list(void* first, kma_page_link_t next);
+
+/***********************************************************************
+ *  Title: Gives back the unused pages of an allocator
+ * ---------------------------------------------------------------------
+ *    Purpose: The body of a shrinker (see page_shrinker()) for an
+ *             allocator laid out as kma_page_layout_t describes. Picks
+ *             up to npages pages with no block in use, takes their
+ *             blocks off the free lists, unlinks them from the chain
+ *             and releases them PAGEBATCH at a time
+ *    Input: the layout and the number of pages wanted
+ *    Output: the number of pages given back
+ ***********************************************************************/
+EXTERN int shrink_page_list(kma_page_layout_t* layout, int npages);
+
+/***********************************************************************
+ *  Title: Allocates a span of memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates npages pages that are contiguous in the address
+ *             space, starting PAGESIZE aligned. A span of up to
+ *             CHUNKPAGES pages is cut out of one chunk, a longer one
+ *             gets whole chunks of its own mapped back to back. With
+ *             page_config()->remap_spans the pages may come from
+ *             anywhere in the pool and are mapped into a fresh range
+ *             of their own instead, which has no size limit but costs
+ *             an mmap per run of adjacent pages
+ *    Input: the number of pages
+ *    Output: the descriptor of the first page, with ptr set to the span
+ *            and size to its length in bytes, or NULL if the pool has
+ *            no room for the span even after the shrinkers ran and the
+ *            caches were drained, or if a span longer than CHUNKPAGES
+ *            finds no run of free chunk slots (at most MAXCHUNKS *
+ *            CHUNKSIZE bytes) without remap_spans
+ ***********************************************************************/
+EXTERN kma_page_t* get_page_span(int npages);
+
+/***********************************************************************
+ *  Title: Releases a span of memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases all pages of a span
+ *    Input: the descriptor returned by get_page_span
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_page_span(kma_page_t*);
+
+/***********************************************************************
+ *  Title: Allocates a block larger than a page
+ * ---------------------------------------------------------------------
+ *    Purpose: Serves a request too large for an allocator's pages from
+ *             a span of its own, behind a kma_span_hdr_t
+ *    Input: the requested size in bytes
+ *    Output: the block, or NULL if get_page_span refused the span
+ ***********************************************************************/
+EXTERN void* get_span_block(int size);
+
+/***********************************************************************
+ *  Title: Releases a block larger than a page
+ * ---------------------------------------------------------------------
+ *    Purpose: Gives the span behind the block back to the pool
+ *    Input: a block returned by get_span_block
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_span_block(void* ptr);
+
+/***********************************************************************
+ *  Title: Finds the page structure of an address
+ * ---------------------------------------------------------------------
+ *    Purpose: Looks up the descriptor of the pool page that contains
+ *             the given address (constant time, no search)
+ *    Input: any address inside a page handed out by get_page
+ *    Output: the memory page structure or NULL if the address is not
+ *            part of the pool
+ ***********************************************************************/
+EXTERN kma_page_t* find_page(void*);
+
+/***********************************************************************
+ *  Title: Page layer configuration
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the page layer configuration. It may be changed
+ *             until the first page is allocated, the page size is
+ *             checked and fixed at that point
+ *    Input: none
+ *    Output: the live configuration
+ ***********************************************************************/
+EXTERN kma_page_config_t* page_config();
+
+/***********************************************************************
+ *  Title: Attaches a file backed page pool
+ * ---------------------------------------------------------------------
+ *    Purpose: Keeps the pool in the given file, mapped at a fixed
+ *             address, instead of anonymous memory. If the file holds
+ *             a pool detached by an earlier process, the pool is taken
+ *             over as it was: pages, descriptors and free lists are
+ *             used in place and nothing is rebuilt. Otherwise the file
+ *             is set up as a new, empty pool. Must come before the
+ *             first page is allocated, a reopened pool brings its own
+ *             page size and colors. detach_pool() runs at exit
+ *    Input: the path of the pool file, where the caller keeps its
+ *           root pointer (restored on reopen, saved at detach) or NULL,
+ *           and the caller's shrinker (see page_shrinker()) or NULL.
+ *           A reopened heap never runs the allocator's first-page
+ *           setup, so the shrinker is registered here
+ *    Output: TRUE if an existing pool was reopened, FALSE if new
+ ***********************************************************************/
+EXTERN int attach_pool(char* path, void** root, kma_shrinker_t shrink);
+
+/***********************************************************************
+ *  Title: Shares the page pool between processes
+ * ---------------------------------------------------------------------
+ *    Purpose: Puts the pool in shared memory mapped at the fixed
+ *             address of attach_pool(), either a new memfd or the
+ *             given file (e.g. in /dev/shm), which is set up on first
+ *             use and joined after that. Processes forked afterwards
+ *             and processes opening the same file (or /proc/<pid>/fd/
+ *             of the memfd) allocate from the same pages. Each process
+ *             keeps its own allocator heap on top. Must come before
+ *             the first page is allocated
+ *    Input: the file or NULL for a new memfd
+ *    Output: the file descriptor of the pool
+ ***********************************************************************/
+EXTERN int share_pool(char* path);
+
+/***********************************************************************
+ *  Title: Detaches a file backed page pool
+ * ---------------------------------------------------------------------
+ *    Purpose: Returns the pages cached by the calling thread to the
+ *             pool and saves the root pointer and page statistics in
+ *             the file, so that the next attach_pool() can reopen it.
+ *             The pool must not be used afterwards. A shared pool only
+ *             gets the cached pages back. Does nothing with a pool in
+ *             anonymous memory
+ *    Input: none
+ *    Output: none
+ ***********************************************************************/
+EXTERN void detach_pool();
+
 /***********************************************************************
  *  Title: Memory page statistics
  * ---------------------------------------------------------------------
@@ -131,6 +541,53 @@ EXTERN void free_page(kma_page_t*);
  ***********************************************************************/
 EXTERN kma_page_stat_t* page_stats();
 
+/***********************************************************************
+ *  Title: Snapshot of the memory page statistics
+ * ---------------------------------------------------------------------
+ *    Purpose: Like page_stats(), but into the caller's buffer, so that
+ *             threads can take snapshots at the same time. Adds up the
+ *             per thread counters, take it per phase rather than per
+ *             operation
+ *    Input: the buffer
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_snapshot(kma_page_stat_t*);
+
+/***********************************************************************
+ *  Title: Pages in use
+ * ---------------------------------------------------------------------
+ *    Purpose: Cheap read of num_in_use for callers that need it after
+ *             every operation
+ *    Input: none
+ *    Output: the number of pages requested and not yet freed
+ ***********************************************************************/
+EXTERN int page_in_use();
+
+/***********************************************************************
+ *  Title: Resets the page statistics
+ * ---------------------------------------------------------------------
+ *    Purpose: Zeroes the counters (pages requested and freed, peaks,
+ *             residency, latency, spills, shrinks) so that the next
+ *             phase is counted on its own. What the pool holds
+ *             (chunks, resident pages) stays. Needs all pages freed
+ *             and no other thread using the layer
+ *    Input: none
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_reset_stats();
+
+/***********************************************************************
+ *  Title: Advances the residency clock
+ * ---------------------------------------------------------------------
+ *    Purpose: Counts one operation of the caller, e.g. one trace
+ *             record. page_ops adds the pages in use once per tick, so
+ *             the residency does not depend on how fast the replay
+ *             ran. Only one thread ticks
+ *    Input: none
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_tick();
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/
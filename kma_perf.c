@@ -0,0 +1,392 @@
+/***************************************************************************
+ *  Title: Performance Counters
+ * -------------------------------------------------------------------------
+ *    Purpose: Event counters on top of perf_event_open(2)
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#define __KPERF_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/************Private include**********************************************/
+#include "kma_perf.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// back to back perf_read calls to find what they count themselves
+#define CALIBRATIONS 1000
+
+// what read(2) of a counter gives with the read_format below
+typedef struct
+{
+  unsigned long long value;
+  unsigned long long enabled;   // ns the counter was enabled
+  unsigned long long running;   // ns it was on the PMU, less if multiplexed
+} perf_value_t;
+
+#define CACHE_MISS(cache) ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) \
+			   | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+typedef struct
+{
+  char* name;
+  unsigned int type;
+  unsigned long long config;
+} perf_event_t;
+
+/************Global Variables*********************************************/
+
+static perf_event_t perf_table[] =
+  {
+    { "cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES             },
+    { "instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS           },
+    { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES          },
+    { "cache-misses",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES           },
+    { "l1d-misses",    PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_L1D)  },
+    { "llc-misses",    PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_LL)   },
+    { "dtlb-misses",   PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB) },
+    { "minor-faults",  PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN        },
+    { "major-faults",  PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ        },
+    { NULL,            0,                  0                                    }
+  };
+
+/************Function Prototypes******************************************/
+int openEvent(perf_event_t*);
+void* mapEvent(int);
+long long readEvent(kma_perf_t*, int);
+int rdpmcEvent(struct perf_event_mmap_page*, long long*);
+void calibrate(kma_perf_t*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+perf_open(kma_perf_t* perf, char* events)
+{
+  char* list;
+  char* name;
+  int opened = 0;
+  int i;
+
+  if (strcmp(events, "default") == 0)
+    {
+      events = PERF_DEFAULT;
+    }
+  list = strdup(events);
+  assert(list != NULL);
+  memset(perf, 0, sizeof(kma_perf_t));
+
+  for (name = strtok(list, ","); name != NULL; name = strtok(NULL, ","))
+    {
+      if (perf->num == PERF_MAXCOUNTERS)
+	{
+	  error("too many perf events", events);
+	}
+      for (i = 0; perf_table[i].name != NULL; i++)
+	{
+	  if (strcmp(perf_table[i].name, name) == 0)
+	    break;
+	}
+      if (perf_table[i].name == NULL)
+	{
+	  error("unknown perf event", name);
+	}
+
+      perf->names[perf->num] = perf_table[i].name;
+      perf->fds[perf->num] = openEvent(&perf_table[i]);
+      if (perf->fds[perf->num] >= 0)
+	{
+	  perf->pages[perf->num] = mapEvent(perf->fds[perf->num]);
+	  opened++;
+	}
+      else
+	{
+	  perf->errs[perf->num] = errno;
+	}
+      perf->num++;
+    }
+
+  free(list);
+  if (opened > 0)
+    {
+      calibrate(perf);
+    }
+  return opened;
+}
+
+void
+perf_read(kma_perf_t* perf, long long values[])
+{
+  int i;
+
+  for (i = 0; i < perf->num; i++)
+    {
+      if (perf->fds[i] >= 0)
+	values[i] = readEvent(perf, i);
+    }
+}
+
+void
+perf_add(kma_perf_t* perf, long long sums[], long long start[])
+{
+  long long now[PERF_MAXCOUNTERS];
+  long long count;
+  int i;
+
+  perf_read(perf, now);
+  for (i = 0; i < perf->num; i++)
+    {
+      if (perf->fds[i] < 0)
+	continue;
+      count = now[i] - start[i] - perf->overhead[i];
+      if (count > 0)
+	sums[i] += count;
+    }
+}
+
+void
+perf_start(kma_perf_t* perf)
+{
+  int i;
+
+  for (i = 0; i < perf->num; i++)
+    {
+      if (perf->fds[i] >= 0)
+	ioctl(perf->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+void
+perf_stop(kma_perf_t* perf)
+{
+  perf_value_t value;
+  int i;
+
+  for (i = 0; i < perf->num; i++)
+    {
+      if (perf->fds[i] < 0)
+	continue;
+      ioctl(perf->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+      if (read(perf->fds[i], &value, sizeof(value)) == sizeof(value))
+	{
+	  // counted only part of the time, extrapolate to all of it
+	  perf->raw[i] += value.value;
+	  if (value.running > 0 && value.running < value.enabled)
+	    perf->values[i] += (double) value.value * value.enabled
+	      / value.running;
+	  else
+	    perf->values[i] += value.value;
+	}
+      ioctl(perf->fds[i], PERF_EVENT_IOC_RESET, 0);
+    }
+}
+
+void
+perf_print(kma_perf_t* perf, char* prefix)
+{
+  int i;
+
+  for (i = 0; i < perf->num; i++)
+    {
+      if (perf->fds[i] < 0)
+	printf("%s%-14s %14s (%s)\n", prefix, perf->names[i], "n/a",
+	       strerror(perf->errs[i]));
+      else
+	printf("%s%-14s %14lld\n", prefix, perf->names[i], perf->values[i]);
+    }
+}
+
+void
+perf_print_per(kma_perf_t* perf, char* label, long long sums[],
+	       unsigned long long n)
+{
+  double scale;
+  int any = FALSE;
+  int i;
+
+  for (i = 0; i < perf->num; i++)
+    {
+      if (perf->fds[i] < 0)
+	continue;
+      scale = (perf->raw[i] > 0) ? (double) perf->values[i] / perf->raw[i]
+	: 1.0;
+      if (!any)
+	printf("Perf per %s", label);
+      printf("%s %s %.4g", any ? "," : "", perf->names[i],
+	     n > 0 ? sums[i] * scale / n : 0.0);
+      any = TRUE;
+    }
+  if (any)
+    {
+      printf(" (%llu ops)\n", n);
+    }
+}
+
+void
+perf_close(kma_perf_t* perf)
+{
+  int i;
+
+  for (i = 0; i < perf->num; i++)
+    {
+      if (perf->pages[i] != NULL)
+	munmap(perf->pages[i], sysconf(_SC_PAGESIZE));
+      if (perf->fds[i] >= 0)
+	close(perf->fds[i]);
+      perf->pages[i] = NULL;
+      perf->fds[i] = -1;
+    }
+}
+
+char*
+perf_events()
+{
+  static char list[256];
+  int i;
+
+  list[0] = '\0';
+  for (i = 0; perf_table[i].name != NULL; i++)
+    {
+      if (i > 0)
+	strcat(list, ",");
+      strcat(list, perf_table[i].name);
+    }
+
+  return list;
+}
+
+// opens one disabled, user space only counter for this thread, -1 if the
+// event is not supported here (no PMU in the VM, paranoid setting, ...)
+int
+openEvent(perf_event_t* event)
+{
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = event->type;
+  attr.config = event->config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+    | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// the page the kernel keeps the counter's PMU index and offset in, so
+// that it can be read without a system call. NULL if that is not allowed
+void*
+mapEvent(int fd)
+{
+  void* page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd,
+		    0);
+
+  return (page == MAP_FAILED) ? NULL : page;
+}
+
+// the running count of counter i. Software events, and counters the
+// kernel multiplexed out, go through read(2)
+long long
+readEvent(kma_perf_t* perf, int i)
+{
+  perf_value_t value;
+  long long count;
+
+  if (perf->pages[i] != NULL && rdpmcEvent(perf->pages[i], &count))
+    {
+      return count;
+    }
+
+  if (read(perf->fds[i], &value, sizeof(value)) != sizeof(value))
+    {
+      return 0;
+    }
+  return value.value;
+}
+
+// the count from the PMU while the counter sits on it, retried if the
+// kernel updated the page meanwhile. FALSE if it is not on the PMU or
+// user space may not read it
+int
+rdpmcEvent(struct perf_event_mmap_page* pc, long long* count)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int seq, index;
+  long long pmc;
+  int width;
+
+  if (!pc->cap_user_rdpmc)
+    {
+      return FALSE;
+    }
+  do
+    {
+      seq = pc->lock;
+      __asm__ __volatile__ ("" ::: "memory");
+      index = pc->index;
+      *count = pc->offset;
+      width = pc->pmc_width;
+      if (index != 0)
+	{
+	  // sign extend the width bits the PMU has
+	  pmc = __builtin_ia32_rdpmc(index - 1);
+	  *count += (pmc << (64 - width)) >> (64 - width);
+	}
+      __asm__ __volatile__ ("" ::: "memory");
+    }
+  while (pc->lock != seq);
+  return index != 0;
+#else
+  return FALSE;
+#endif
+}
+
+// perf_read right after perf_read, the least each counter moved
+void
+calibrate(kma_perf_t* perf)
+{
+  long long before[PERF_MAXCOUNTERS];
+  long long after[PERF_MAXCOUNTERS];
+  int i, j;
+
+  perf_start(perf);
+  for (i = 0; i < CALIBRATIONS; i++)
+    {
+      perf_read(perf, before);
+      perf_read(perf, after);
+      for (j = 0; j < perf->num; j++)
+	{
+	  if (perf->fds[j] >= 0
+	      && (i == 0 || after[j] - before[j] < perf->overhead[j]))
+	    perf->overhead[j] = after[j] - before[j];
+	}
+    }
+  perf_stop(perf);
+  memset(perf->values, 0, sizeof(perf->values));
+  memset(perf->raw, 0, sizeof(perf->raw));
+}
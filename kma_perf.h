@@ -0,0 +1,152 @@
+/***************************************************************************
+ *  Title: Performance Counters
+ * -------------------------------------------------------------------------
+ *    Purpose: Interface for reading hardware/software event counters
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#ifndef __KPERF_H__
+#define __KPERF_H__
+
+/************System include***********************************************/
+
+/************Private include**********************************************/
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#undef EXTERN
+#ifdef __KPERF_IMPL__
+#define EXTERN
+#else
+#define EXTERN extern
+#endif
+
+#define PERF_MAXCOUNTERS 8
+
+/* what -e default counts */
+#define PERF_DEFAULT \
+  "cycles,instructions,l1d-misses,llc-misses,branch-misses,dtlb-misses"
+
+typedef struct
+{
+  int num;                              /* counters requested */
+  char* names[PERF_MAXCOUNTERS];
+  int fds[PERF_MAXCOUNTERS];            /* -1 if the event is unavailable */
+  int errs[PERF_MAXCOUNTERS];           /* errno of an unavailable one */
+  void* pages[PERF_MAXCOUNTERS];        /* mapped for rdpmc, NULL if not */
+  long long overhead[PERF_MAXCOUNTERS]; /* counted by perf_read itself */
+  long long values[PERF_MAXCOUNTERS];   /* accumulated while started,
+					   scaled up if multiplexed */
+  long long raw[PERF_MAXCOUNTERS];      /* the same, not scaled */
+} kma_perf_t;
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Opens a set of event counters
+ * ---------------------------------------------------------------------
+ *    Purpose: Opens one counter per event for the calling thread,
+ *             counting user space only. Events the kernel, the CPU or
+ *             the container does not support are kept but marked
+ *             unavailable. Measures what perf_read costs in each
+ *             counter
+ *    Input: the counter set, a comma separated list of event names
+ *           (see perf_events()) or "default" for PERF_DEFAULT
+ *    Output: the number of counters that could be opened
+ ***********************************************************************/
+EXTERN int perf_open(kma_perf_t*, char* events);
+
+/***********************************************************************
+ *  Title: Reads the counters
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the current count of every available counter while
+ *             started, from user space with rdpmc where the kernel
+ *             allows it and with read(2) otherwise. Only differences
+ *             between two reads mean anything
+ *    Input: the counter set, PERF_MAXCOUNTERS values to fill in
+ *    Output: none
+ ***********************************************************************/
+EXTERN void perf_read(kma_perf_t*, long long values[]);
+
+/***********************************************************************
+ *  Title: Counts one operation
+ * ---------------------------------------------------------------------
+ *    Purpose: Adds the counts since start, less what perf_read itself
+ *             counts, to the sums of an operation
+ *    Input: the counter set, the sums, the values perf_read gave
+ *           before the operation
+ *    Output: none
+ ***********************************************************************/
+EXTERN void perf_add(kma_perf_t*, long long sums[], long long start[]);
+
+/***********************************************************************
+ *  Title: Starts/stops counting
+ * ---------------------------------------------------------------------
+ *    Purpose: Enables or disables all counters of the set. Values
+ *             accumulate over several start/stop intervals
+ *    Input: the counter set
+ *    Output: none
+ ***********************************************************************/
+EXTERN void perf_start(kma_perf_t*);
+EXTERN void perf_stop(kma_perf_t*);
+
+/***********************************************************************
+ *  Title: Prints the counters
+ * ---------------------------------------------------------------------
+ *    Purpose: Prints one line per counter, "n/a" and the reason if
+ *             unavailable
+ *    Input: the counter set, a prefix for every line
+ *    Output: none
+ ***********************************************************************/
+EXTERN void perf_print(kma_perf_t*, char* prefix);
+
+/***********************************************************************
+ *  Title: Prints the counts of an operation
+ * ---------------------------------------------------------------------
+ *    Purpose: Prints the sums of perf_add divided by the number of
+ *             operations on one line, scaled like the totals if the
+ *             kernel multiplexed the counters. Prints nothing if no
+ *             counter is available
+ *    Input: the counter set, a label, the sums, the number of
+ *           operations
+ *    Output: none
+ ***********************************************************************/
+EXTERN void perf_print_per(kma_perf_t*, char* label, long long sums[],
+			   unsigned long long n);
+
+/***********************************************************************
+ *  Title: Closes a set of event counters
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases the counters
+ *    Input: the counter set
+ *    Output: none
+ ***********************************************************************/
+EXTERN void perf_close(kma_perf_t*);
+
+/***********************************************************************
+ *  Title: Known events
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the comma separated list of event names perf_open
+ *             understands
+ *    Input: none
+ *    Output: the list
+ ***********************************************************************/
+EXTERN char* perf_events();
+
+/************External Declaration*****************************************/
+
+/**************Definition***************************************************/
+
+#endif /* __KPERF_H__ */
@@ -0,0 +1,118 @@
+/***************************************************************************
+ *  Title: Allocator Registry
+ * -------------------------------------------------------------------------
+ *    Purpose: kma_malloc and friends for a program with every allocator
+ *             linked in, going to the one selected
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#define __KREGISTRY_IMPL__
+
+/************System include***********************************************/
+#include <string.h>
+
+/************Private include**********************************************/
+#include "kma_registry.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/************External Declaration*****************************************/
+
+// each built from its kma_<name>.c with -DKMA_REGISTRY, which leaves
+// only this symbol global
+extern kma_allocator_t kma_dummy_allocator;
+extern kma_allocator_t kma_rm_allocator;
+extern kma_allocator_t kma_p2fl_allocator;
+extern kma_allocator_t kma_mck2_allocator;
+extern kma_allocator_t kma_bud_allocator;
+extern kma_allocator_t kma_lzbud_allocator;
+
+/************Global Variables*********************************************/
+
+kma_allocator_t* kma_allocators[] =
+  {
+    &kma_rm_allocator,
+    &kma_p2fl_allocator,
+    &kma_mck2_allocator,
+    &kma_bud_allocator,
+    &kma_lzbud_allocator,
+    &kma_dummy_allocator,
+    NULL
+  };
+
+static kma_allocator_t* current = NULL;
+
+/************Function Prototypes******************************************/
+
+/**************Implementation***********************************************/
+
+kma_allocator_t*
+registry_find(char* name)
+{
+  int i;
+
+  for (i = 0; kma_allocators[i] != NULL; i++)
+    {
+      if (strcmp(kma_allocators[i]->name, name) == 0)
+	return kma_allocators[i];
+    }
+
+  return NULL;
+}
+
+void
+registry_use(kma_allocator_t* allocator)
+{
+  current = allocator;
+  memset(&current->stats, 0, sizeof(kma_alloc_stat_t));
+}
+
+void*
+kma_malloc(kma_size_t size)
+{
+  kma_alloc_stat_t* stats = &current->stats;
+  void* ptr = current->malloc(size);
+
+  stats->num_malloc++;
+  if (ptr == NULL)
+    {
+      stats->num_refused++;
+      return NULL;
+    }
+
+  stats->bytes_in_use += size;
+  if (stats->bytes_in_use > stats->peak_bytes)
+    stats->peak_bytes = stats->bytes_in_use;
+  return ptr;
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  current->free(ptr, size);
+  current->stats.num_free++;
+  current->stats.bytes_in_use -= size;
+}
+
+int
+kma_attach(char* path)
+{
+  return current->attach(path);
+}
+
+void
+kma_reset()
+{
+  current->reset();
+}
@@ -0,0 +1,67 @@
+/***************************************************************************
+ *  Title: Allocator Registry
+ * -------------------------------------------------------------------------
+ *    Purpose: Interface for picking one of several allocators linked
+ *             into the same program at run time
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#ifndef __KREGISTRY_H__
+#define __KREGISTRY_H__
+
+/************System include***********************************************/
+
+/************Private include**********************************************/
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#undef EXTERN
+#ifdef __KREGISTRY_IMPL__
+#define EXTERN
+#else
+#define EXTERN extern
+#endif
+
+/************Global Variables*********************************************/
+
+/* every allocator linked in, NULL terminated */
+EXTERN kma_allocator_t* kma_allocators[];
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Finds an allocator
+ * ---------------------------------------------------------------------
+ *    Purpose: Looks up an allocator by its name ("rm", "bud", ...)
+ *    Input: the name
+ *    Output: the allocator, NULL if none has that name
+ ***********************************************************************/
+EXTERN kma_allocator_t* registry_find(char* name);
+
+/***********************************************************************
+ *  Title: Selects an allocator
+ * ---------------------------------------------------------------------
+ *    Purpose: Makes kma_malloc, kma_free, kma_attach and kma_reset go
+ *             to the allocator and zeroes its counters. Switch only
+ *             between replays, with nothing allocated
+ *    Input: the allocator
+ *    Output: none
+ ***********************************************************************/
+EXTERN void registry_use(kma_allocator_t*);
+
+/************External Declaration*****************************************/
+
+/**************Definition***************************************************/
+
+#endif /* __KREGISTRY_H__ */
@@ -62,8 +62,14 @@ typedef struct {
   int freed_block;
   //remeber total_pages for traversal
   int total_pages;  
+  //pool pages need not be contiguous, so chain them for free_all
+  void* next_page;
 } pg_hdr_t;
 
+//requests that do not fit a page behind its header and a free block
+//header get a page of their own
+#define WHOLE_PAGE(size) ((size) + sizeof(pg_hdr_t) + sizeof(blk_ptr_t) > PAGESIZE)
+
 /************Global Variables*********************************************/
 
 static kma_page_t* entry_page = NULL;
@@ -71,12 +77,14 @@ static kma_page_t* entry_page = NULL;
 /************Function Prototypes******************************************/
 void* kma_malloc(kma_size_t);
 void make_new_page();
-void add_to_free_list(blk_ptr_t*, int);
+static void add_to_free_list(blk_ptr_t*, int);
 //void remove_from_free_list(blk_ptr_t*);
-blk_ptr_t* find_first_fit(int);
+static blk_ptr_t* find_first_fit(int);
 void PrintFreeList();
-void coalesce();
-void free_all();
+static void coalesce();
+static void free_all();
+static kma_page_t* next_in_chain(void**);
+static int shrink_pages(int);
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
@@ -85,10 +93,11 @@ void*
 kma_malloc(kma_size_t size)
 {
   if (size + sizeof(void*) > PAGESIZE) {
-    return NULL;
+    return get_span_block(size);
   }
 
   if (entry_page == NULL) {
+    page_shrinker(shrink_pages);
     kma_page_t* new_page = get_page();
 
     entry_page = new_page;
@@ -100,19 +109,27 @@ kma_malloc(kma_size_t size)
     page_header->allocated_block = 0;
     page_header->freed_block = 0;
     page_header->total_pages = 0;
+    page_header->next_page = NULL;
     blk_ptr_t* pos_to_add = (blk_ptr_t*)page_header->free_list;
     int size_to_add = PAGESIZE - sizeof(pg_hdr_t);
 	  add_to_free_list(pos_to_add, size_to_add);
   }
+  pg_hdr_t* first_page = (pg_hdr_t*)(entry_page->ptr);
+  //too large to sit behind a page header, give it a page of its own
+  if (WHOLE_PAGE(size)) {
+    kma_page_t* page = get_page();
+    *((kma_page_t**)page->ptr) = page;
+    (first_page->allocated_block)++;
+    return (void*)page->ptr + sizeof(kma_page_t*);
+  }
   blk_ptr_t* block;
   block = find_first_fit(size);
-  pg_hdr_t* first_page = (pg_hdr_t*)(entry_page->ptr);
 	(first_page->allocated_block)++;
 
   return (void*)block;
 }
 //add to free_list in an order
-void add_to_free_list(blk_ptr_t* block, kma_size_t size) {
+static void add_to_free_list(blk_ptr_t* block, kma_size_t size) {
   pg_hdr_t* first_page_header = (pg_hdr_t*)(entry_page->ptr);
   blk_ptr_t* current = first_page_header->free_list;
   blk_ptr_t* prev = current;
@@ -136,6 +153,7 @@ void add_to_free_list(blk_ptr_t* block, kma_size_t size) {
   else {
   	if (current->next == NULL) {
   		current->next = block;
+  		block->next = NULL;
   	}
   	else {
   		prev = first_page_header->free_list;
@@ -155,7 +173,7 @@ void add_to_free_list(blk_ptr_t* block, kma_size_t size) {
 	}	
 }
 //we find first fit to get the block
-blk_ptr_t* find_first_fit(int size) {
+static blk_ptr_t* find_first_fit(int size) {
   int min_size = sizeof(blk_ptr_t);
   if (size < sizeof(blk_ptr_t)) {
     size = min_size;
@@ -204,6 +222,8 @@ blk_ptr_t* find_first_fit(int size) {
   page_header->allocated_block = 0;
   page_header->freed_block = 0;
   page_header->total_pages = 0;
+  page_header->next_page = first_page_header->next_page;
+  first_page_header->next_page = page_header;
   void* pos_to_add = (void*)page_header + sizeof(pg_hdr_t) + size;
   int size_to_add = PAGESIZE - sizeof(pg_hdr_t)-size;
   add_to_free_list((blk_ptr_t*)pos_to_add, size_to_add);
@@ -216,10 +236,18 @@ blk_ptr_t* find_first_fit(int size) {
 void
 kma_free(void* ptr, kma_size_t size)
 {
-  blk_ptr_t* block = (blk_ptr_t*)ptr;
-  add_to_free_list(block, size);
- 	coalesce();
+  if (size + sizeof(void*) > PAGESIZE) {
+    free_span_block(ptr);
+    return;
+  }
   pg_hdr_t* first_page = entry_page->ptr;
+  if (WHOLE_PAGE(size)) {
+    free_page(*((kma_page_t**)ptr - 1));
+  } else {
+    blk_ptr_t* block = (blk_ptr_t*)ptr;
+    add_to_free_list(block, size);
+    coalesce();
+  }
   (first_page->freed_block)++;
 
   if (first_page->allocated_block == first_page->freed_block) {
@@ -229,20 +257,19 @@ kma_free(void* ptr, kma_size_t size)
   return;
 }
 //free all pages
-void free_all() {
-  pg_hdr_t* first_page = (pg_hdr_t*)(entry_page->ptr);
-  int num = first_page->total_pages;
-  int i = 0;
-  while(i <= num) {
-    pg_hdr_t* current_page = (pg_hdr_t*)((void*)first_page + i*PAGESIZE);
-    kma_page_t* page = (kma_page_t*)current_page->this;
-    free_page(page);
-    i++;
-  }
+static void free_all() {
+  free_page_list(entry_page->ptr, next_in_chain);
   entry_page = NULL;
 }
+
+//free_page_list walker over the next_page chain
+static kma_page_t* next_in_chain(void** cursor) {
+  pg_hdr_t* page = (pg_hdr_t*)*cursor;
+  *cursor = page->next_page;
+  return (kma_page_t*)page->this;
+}
 //traverse the whole free_list
-void coalesce() {
+static void coalesce() {
 	pg_hdr_t* first_page = (pg_hdr_t*)(entry_page->ptr);
 	if (first_page->free_list == NULL) {
 		return;
@@ -259,5 +286,66 @@ void coalesce() {
 	}
 }
 
+//the free list starts in the entry page, so that is all a reopened heap needs
+int kma_attach(char* path) {
+  return attach_pool(path, (void**)&entry_page, shrink_pages);
+}
+
+void kma_reset() {
+  if (entry_page != NULL)
+    free_all();
+}
+
+//shrinker: a page whose free block spans all of it behind the header is
+//unused, take the block off the free list and give the page back. The
+//entry page holds the free list and stays
+static int shrink_pages(int npages) {
+  if (entry_page == NULL)
+    return 0;
+  pg_hdr_t* first_page = (pg_hdr_t*)(entry_page->ptr);
+  int whole = PAGESIZE - sizeof(pg_hdr_t);
+  int found = 0;
+  blk_ptr_t* prev = NULL;
+  blk_ptr_t* current = first_page->free_list;
+  while (current != NULL && found < npages) {
+    pg_hdr_t* page = (pg_hdr_t*)((void*)current - sizeof(pg_hdr_t));
+    if (current->size == whole && BASEADDR(current) == (void*)page
+        && page != first_page) {
+      if (prev == NULL)
+        first_page->free_list = current->next;
+      else
+        prev->next = current->next;
+      //mark it for the walk over the pages below
+      page->free_list = NULL;
+      found++;
+    } else {
+      prev = current;
+    }
+    current = current->next;
+  }
+  //unlink the marked pages from the chain
+  kma_page_t* batch[PAGEBATCH];
+  int n = 0;
+  pg_hdr_t* before = first_page;
+  while (before->next_page != NULL) {
+    pg_hdr_t* page = (pg_hdr_t*)before->next_page;
+    if (page->free_list != NULL) {
+      before = page;
+      continue;
+    }
+    before->next_page = page->next_page;
+    (first_page->total_pages)--;
+    batch[n++] = (kma_page_t*)page->this;
+    if (n == PAGEBATCH) {
+      free_pages(batch, n);
+      n = 0;
+    }
+  }
+  free_pages(batch, n);
+  return found;
+}
+
+kma_allocator_t kma_rm_allocator =
+  { "rm", kma_malloc, kma_free, kma_attach, kma_reset };
 
 #endif // KMA_RM
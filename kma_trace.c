@@ -0,0 +1,309 @@
+/***************************************************************************
+ *  Title: Trace Files
+ * -------------------------------------------------------------------------
+ *    Purpose: Text and binary request traces
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#define __KTRACE_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/************Private include**********************************************/
+#include "kma_trace.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+int mapTrace(kma_trace_t*, char*);
+void parseTrace(kma_trace_t*, char*);
+int parseRecord(FILE*, kma_trace_rec_t*);
+void checkTrace(kma_trace_t*, char*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void
+trace_load(kma_trace_t* trace, char* path)
+{
+  memset(trace, 0, sizeof(kma_trace_t));
+
+  if (!mapTrace(trace, path))
+    {
+      parseTrace(trace, path);
+    }
+  checkTrace(trace, path);
+}
+
+void
+trace_open(kma_trace_t* trace, char* path)
+{
+  kma_trace_hdr_t hdr;
+
+  memset(trace, 0, sizeof(kma_trace_t));
+  trace->file = fopen(path, "r");
+  if (trace->file == NULL)
+    {
+      error("unable to open input test file", path);
+    }
+
+  if (fread(&hdr, sizeof(hdr), 1, trace->file) == 1
+      && hdr.magic == TRACEMAGIC)
+    {
+      trace->binary = TRUE;
+      trace->n_req = hdr.n_req;
+    }
+  else
+    {
+      // the number of requests at the head is optional here
+      rewind(trace->file);
+      if (fscanf(trace->file, "%d", &trace->n_req) != 1)
+	trace->n_req = 0;
+    }
+
+  trace->recs = malloc(TRACEBATCH * sizeof(kma_trace_rec_t));
+  assert(trace->recs != NULL);
+}
+
+long
+trace_next(kma_trace_t* trace)
+{
+  struct timespec start, end;
+  long n = 0;
+  int i;
+
+  if (trace->file == NULL)
+    {
+      return 0;
+    }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (trace->binary)
+    {
+      n = fread(trace->recs, sizeof(kma_trace_rec_t), TRACEBATCH,
+		trace->file);
+      for (i = 0; i < n; i++)
+	{
+	  if (!TRACE_ISFREE(&trace->recs[i]) && trace->recs[i].size <= 0)
+	    error("bad request size", "binary trace");
+	}
+    }
+  else
+    {
+      while (n < TRACEBATCH && parseRecord(trace->file, &trace->recs[n]))
+	n++;
+    }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  trace->n_recs = n;
+  trace->n_ops += n;
+  trace->read_ms += (end.tv_sec - start.tv_sec) * 1e3
+    + (end.tv_nsec - start.tv_nsec) / 1e6;
+  return n;
+}
+
+void
+trace_save(kma_trace_t* trace, char* path)
+{
+  kma_trace_hdr_t hdr;
+  FILE* f = fopen(path, "w");
+
+  if (f == NULL)
+    {
+      error("unable to open binary trace", path);
+    }
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = TRACEMAGIC;
+  hdr.n_req = trace->n_req;
+  hdr.n_ops = trace->n_ops;
+  if (fwrite(&hdr, sizeof(hdr), 1, f) != 1
+      || fwrite(trace->recs, sizeof(kma_trace_rec_t), trace->n_ops, f)
+      != trace->n_ops || fclose(f) != 0)
+    {
+      error("unable to write binary trace", path);
+    }
+}
+
+void
+trace_unload(kma_trace_t* trace)
+{
+  if (trace->file != NULL)
+    {
+      fclose(trace->file);
+      trace->file = NULL;
+    }
+  if (trace->length > 0)
+    {
+      munmap((void*) trace->recs - sizeof(kma_trace_hdr_t), trace->length);
+    }
+  else
+    {
+      free(trace->recs);
+    }
+  trace->recs = NULL;
+}
+
+// maps the file if it is a binary trace, FALSE if it is not
+int
+mapTrace(kma_trace_t* trace, char* path)
+{
+  kma_trace_hdr_t* hdr;
+  struct stat st;
+  void* map;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &st) != 0)
+    {
+      error("unable to open input test file", path);
+    }
+  if (st.st_size < sizeof(kma_trace_hdr_t))
+    {
+      close(fd);
+      return FALSE;
+    }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    {
+      error("unable to map input test file", path);
+    }
+
+  hdr = (kma_trace_hdr_t*) map;
+  if (hdr->magic != TRACEMAGIC)
+    {
+      munmap(map, st.st_size);
+      return FALSE;
+    }
+  if (hdr->n_ops < 0 || st.st_size < sizeof(kma_trace_hdr_t)
+      + (size_t) hdr->n_ops * sizeof(kma_trace_rec_t))
+    {
+      error("binary trace is truncated", path);
+    }
+
+  trace->n_req = hdr->n_req;
+  trace->n_ops = hdr->n_ops;
+  trace->recs = (kma_trace_rec_t*) (hdr + 1);
+  trace->n_recs = hdr->n_ops;
+  trace->binary = TRUE;
+  trace->length = st.st_size;
+  return TRUE;
+}
+
+// "n_req" then one "REQUEST id size" or "FREE id" line per operation
+void
+parseTrace(kma_trace_t* trace, char* path)
+{
+  FILE* f = fopen(path, "r");
+  long max_ops = 1024;
+
+  if (f == NULL)
+    {
+      error("unable to open input test file", path);
+    }
+  if (fscanf(f, "%d\n", &trace->n_req) != 1)
+    {
+      error("Couldn't read number of requests at head of file", "");
+    }
+
+  trace->recs = malloc(max_ops * sizeof(kma_trace_rec_t));
+  assert(trace->recs != NULL);
+
+  while (TRUE)
+    {
+      if (trace->n_ops == max_ops)
+	{
+	  max_ops *= 2;
+	  trace->recs = realloc(trace->recs, max_ops * sizeof(kma_trace_rec_t));
+	  assert(trace->recs != NULL);
+	}
+      if (!parseRecord(f, &trace->recs[trace->n_ops]))
+	break;
+      trace->n_ops++;
+    }
+  trace->n_recs = trace->n_ops;
+  fclose(f);
+}
+
+// reads one "REQUEST id size" or "FREE id" line, FALSE at the end
+int
+parseRecord(FILE* f, kma_trace_rec_t* rec)
+{
+  char command[16];
+  int req_id, req_size;
+
+  if (fscanf(f, "%10s", command) != 1)
+    {
+      return FALSE;
+    }
+
+  if (strcmp(command, "REQUEST") == 0)
+    {
+      if (fscanf(f, "%d %d", &req_id, &req_size) != 2)
+	error("Not enough arguments to REQUEST", "");
+      if (req_id < 0 || req_size <= 0)
+	error("bad request", command);
+      rec->op_id = (unsigned int) req_id << 1;
+      rec->size = req_size;
+    }
+  else if (strcmp(command, "FREE") == 0)
+    {
+      if (fscanf(f, "%d", &req_id) != 1)
+	error("Not enough arguments to FREE", "");
+      if (req_id < 0)
+	error("bad request", command);
+      rec->op_id = ((unsigned int) req_id << 1) | 1;
+      rec->size = 0;
+    }
+  else
+    {
+      error("unknown command type:", command);
+    }
+
+  return TRUE;
+}
+
+// the checks the replay loop would otherwise make on every operation
+void
+checkTrace(kma_trace_t* trace, char* path)
+{
+  kma_trace_rec_t* rec;
+  int i;
+
+  if (trace->n_req < 0)
+    {
+      error("bad number of requests", path);
+    }
+  for (i = 0; i < trace->n_ops; i++)
+    {
+      rec = &trace->recs[i];
+      if (TRACE_ID(rec) >= trace->n_req)
+	error("request id out of range", path);
+      if (!TRACE_ISFREE(rec) && rec->size <= 0)
+	error("bad request size", path);
+    }
+}
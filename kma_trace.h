@@ -0,0 +1,132 @@
+/***************************************************************************
+ *  Title: Trace Files
+ * -------------------------------------------------------------------------
+ *    Purpose: Interface for loading request traces, as text or in a
+ *             binary form that is replayed straight from the mapping
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/************************************************************************
+ Project Group: NetID1, NetID2, NetID3
+
+ ***************************************************************************/
+
+#ifndef __KTRACE_H__
+#define __KTRACE_H__
+
+/************System include***********************************************/
+#include <stddef.h>
+#include <stdio.h>
+
+/************Private include**********************************************/
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#undef EXTERN
+#ifdef __KTRACE_IMPL__
+#define EXTERN
+#else
+#define EXTERN extern
+#endif
+
+/* a binary trace is a kma_trace_hdr_t followed by n_ops records, in the
+   byte order of the machine that wrote it */
+#define TRACEMAGIC 0x0031435254414d4bUL  // "KMATRC1"
+
+typedef struct
+{
+  unsigned long magic;
+  int n_req;    /* request ids are below this */
+  int n_ops;
+} kma_trace_hdr_t;
+
+typedef struct
+{
+  unsigned int op_id;  /* request id << 1, the low bit set for a free */
+  int size;            /* 0 for a free */
+} kma_trace_rec_t;
+
+// records read at a time from a streamed trace
+#define TRACEBATCH 4096
+
+#define TRACE_ID(rec) ((rec)->op_id >> 1)
+#define TRACE_ISFREE(rec) ((rec)->op_id & 1)
+
+typedef struct
+{
+  int n_req;        /* 0 if a streamed trace does not say */
+  long n_ops;       /* read so far if streamed */
+  kma_trace_rec_t* recs;
+  long n_recs;      /* in recs: all of them, or the current batch */
+  int binary;
+  size_t length;    /* of the mapping, 0 if not mapped */
+  FILE* file;       /* a streamed trace is read from here */
+  double read_ms;   /* spent reading batches */
+} kma_trace_t;
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Loads a trace
+ * ---------------------------------------------------------------------
+ *    Purpose: Maps a binary trace (read ahead, so that replaying it
+ *             takes no page faults) or parses a text trace into
+ *             records. Either way the records are checked once here,
+ *             so that a replay can use them as they are
+ *    Input: the trace, the path of the file
+ *    Output: none, errors out on a bad file
+ ***********************************************************************/
+EXTERN void trace_load(kma_trace_t*, char* path);
+
+/***********************************************************************
+ *  Title: Opens a trace for streaming
+ * ---------------------------------------------------------------------
+ *    Purpose: Opens a text or binary trace to be read a batch at a
+ *             time with trace_next, so that it may be larger than
+ *             memory. The counts in the header are not needed
+ *    Input: the trace, the path of the file
+ *    Output: none, errors out if it cannot be opened
+ ***********************************************************************/
+EXTERN void trace_open(kma_trace_t*, char* path);
+
+/***********************************************************************
+ *  Title: Reads the next batch of a streamed trace
+ * ---------------------------------------------------------------------
+ *    Purpose: Replaces the records with up to TRACEBATCH following
+ *             ones. A loaded trace has all of its records from the
+ *             start and no next batch
+ *    Input: the trace
+ *    Output: the number of records read, 0 at the end
+ ***********************************************************************/
+EXTERN long trace_next(kma_trace_t*);
+
+/***********************************************************************
+ *  Title: Writes a binary trace
+ * ---------------------------------------------------------------------
+ *    Purpose: Saves the records of a loaded trace in the binary form
+ *    Input: the trace, the path of the file to write
+ *    Output: none, errors out if it cannot be written
+ ***********************************************************************/
+EXTERN void trace_save(kma_trace_t*, char* path);
+
+/***********************************************************************
+ *  Title: Unloads a trace
+ * ---------------------------------------------------------------------
+ *    Purpose: Unmaps or frees the records, closes a streamed trace
+ *    Input: the trace
+ *    Output: none
+ ***********************************************************************/
+EXTERN void trace_unload(kma_trace_t*);
+
+/************External Declaration*****************************************/
+
+/**************Definition***************************************************/
+
+#endif /* __KTRACE_H__ */